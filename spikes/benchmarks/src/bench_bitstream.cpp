@@ -0,0 +1,128 @@
+#include "pch.hpp"
+
+#include "common/engine/network/network_buffers.hpp"
+
+#include "bench.hpp"
+
+#define BENCH_BITSTREAM_PACKETS       ( 100000 )
+#define BENCH_BITSTREAM_MESSAGES      ( 12 )
+#define BENCH_BITSTREAM_PASSES        ( 10 )
+
+namespace
+{
+    /* a NetworkPayloadHeader followed by a dozen entity updates of the shape a snapshot would carry */
+    struct EntityUpdate
+    {
+        uint8_t message_type;
+        uint16_t entity_id;
+        uint32_t position_x;
+        uint32_t position_y;
+        uint32_t position_z;
+        bool alive;
+        uint8_t health;
+    };
+
+    struct Packet
+    {
+        uint64_t client_id;
+        uint16_t sequence;
+        uint16_t packet_ack_recent_sequence;
+        uint32_t packet_ack_sequence_bits;
+        uint16_t start_message;
+        std::array<EntityUpdate, BENCH_BITSTREAM_MESSAGES> updates;
+    };
+
+    template <typename STREAM, typename PACKET>
+    void SerializePacket( STREAM &stream, PACKET &packet )
+    {
+        stream.Write( packet.client_id );
+        stream.Write( packet.sequence );
+        stream.Write( packet.packet_ack_recent_sequence );
+        stream.Write( packet.packet_ack_sequence_bits );
+        stream.Write( packet.start_message );
+        for( auto &update : packet.updates )
+        {
+            stream.Write( update.message_type, 4 );
+            stream.Write( update.entity_id, 14 );
+            stream.Write( update.position_x, 18 );
+            stream.Write( update.position_y, 18 );
+            stream.Write( update.position_z, 18 );
+            stream.Write( update.alive );
+            stream.Write( update.health, 7 );
+        }
+    }
+
+    std::vector<Packet> MakePackets()
+    {
+        std::mt19937 random( 11 );
+        std::vector<Packet> packets( BENCH_BITSTREAM_PACKETS );
+        for( auto &packet : packets )
+        {
+            packet.client_id = random();
+            packet.sequence = static_cast<uint16_t>( random() );
+            packet.packet_ack_recent_sequence = static_cast<uint16_t>( random() );
+            packet.packet_ack_sequence_bits = random();
+            packet.start_message = static_cast<uint16_t>( random() );
+            for( auto &update : packet.updates )
+            {
+                update.message_type = random() % 16;
+                update.entity_id = random() % ( 1 << 14 );
+                update.position_x = random() % ( 1 << 18 );
+                update.position_y = random() % ( 1 << 18 );
+                update.position_z = random() % ( 1 << 18 );
+                update.alive = ( random() & 1 ) != 0;
+                update.health = random() % 128;
+            }
+        }
+
+        return packets;
+    }
+
+    void PrintBitsPerNanosecond( const char *name, size_t bits, double nanoseconds )
+    {
+        printf( "%-48s %12zu %14.3f bits/ns\n", name, bits, bits / nanoseconds );
+    }
+}
+
+void Bench::RunBitStreamBenchmarks()
+{
+    auto packets = MakePackets();
+    std::vector<byte> buffer( packets.size() * sizeof( Packet ) * 2 );
+
+    size_t bits = 0;
+    printf( "\nPayload header + %d entity updates per packet, %d packets\n", BENCH_BITSTREAM_MESSAGES, BENCH_BITSTREAM_PACKETS );
+    printf( "%-48s %12s %14s\n", "benchmark", "bits", "throughput" );
+
+    auto elapsed = Bench::BestOf( BENCH_BITSTREAM_PASSES, [&]()
+    {
+        auto out = Engine::BitStreamFactory::CreateOutputBitStream( buffer.data(), buffer.size(), false );
+        for( auto &packet : packets )
+        {
+            SerializePacket( *out, packet );
+        }
+
+        bits = out->GetCurrentBitCount();
+    } );
+
+    PrintBitsPerNanosecond( "OutputBitStream", bits, elapsed );
+
+    std::vector<Packet> read_back( packets.size() );
+    elapsed = Bench::BestOf( BENCH_BITSTREAM_PASSES, [&]()
+    {
+        auto in = Engine::BitStreamFactory::CreateInputBitStream( buffer.data(), buffer.size(), false );
+        for( auto &packet : read_back )
+        {
+            SerializePacket( *in, packet );
+        }
+    } );
+
+    PrintBitsPerNanosecond( "InputBitStream", bits, elapsed );
+
+    uint64_t sum = 0;
+    for( size_t i = 0; i < packets.size(); i++ )
+    {
+        sum += read_back[ i ].client_id == packets[ i ].client_id && read_back[ i ].updates.back().position_z == packets[ i ].updates.back().position_z;
+    }
+
+    Bench::Consume( sum );
+}
@@ -0,0 +1,93 @@
+#include "pch.hpp"
+
+#include "common/engine/network/network_message.hpp"
+
+#include "bench.hpp"
+
+#define BENCH_BUDGET_PACKETS          ( 10000 )
+#define BENCH_BUDGET_MAX_CLIENT_ID    ( 4096 )
+#define BENCH_BUDGET_MESSAGES         ( 12 )
+
+namespace
+{
+    /* same fields as NetworkPayloadHeader, which needs the Windows networking headers to build */
+    struct PayloadHeader
+    {
+        uint64_t client_id;
+        uint16_t sequence;
+        uint16_t packet_ack_recent_sequence;
+        uint32_t packet_ack_sequence_bits;
+        uint16_t start_message;
+    };
+
+    void MeasureFixedHeader( Engine::MeasureBitStream &measure, PayloadHeader &header )
+    {
+        measure.Write( header.client_id );
+        measure.Write( header.sequence );
+        measure.Write( header.packet_ack_recent_sequence );
+        measure.Write( header.packet_ack_sequence_bits );
+        measure.Write( header.start_message );
+    }
+
+    void MeasureVariableHeader( Engine::MeasureBitStream &measure, PayloadHeader &header )
+    {
+        measure.WriteVarint( header.client_id );
+        measure.Write( header.sequence );
+        measure.Write( header.packet_ack_recent_sequence );
+        measure.Write( header.packet_ack_sequence_bits );
+        measure.Write( header.start_message );
+    }
+
+    void PrintBudget( const char *name, double fixed_bits, double variable_bits )
+    {
+        printf( "%-48s %12.1f %12.1f %9.1f%%\n", name, fixed_bits, variable_bits, 100.0 * ( fixed_bits - variable_bits ) / fixed_bits );
+    }
+}
+
+void Bench::RunBitBudgetReport()
+{
+    std::mt19937 random( 5 );
+    Engine::MeasureBitStream fixed_header;
+    Engine::MeasureBitStream variable_header;
+    Engine::MeasureBitStream fixed_messages;
+    Engine::MeasureBitStream variable_messages;
+
+    /* a message resent up to a few times sits a few sequences behind the first message in its packet */
+    auto message = Engine::NetworkMessageFactory::CreateMessage( Engine::MESSAGE_TEST );
+    for( auto i = 0; i < BENCH_BUDGET_PACKETS; i++ )
+    {
+        PayloadHeader header;
+        header.client_id = 1 + random() % BENCH_BUDGET_MAX_CLIENT_ID;
+        header.sequence = static_cast<uint16_t>( random() );
+        header.packet_ack_recent_sequence = static_cast<uint16_t>( random() );
+        header.packet_ack_sequence_bits = random();
+        header.start_message = static_cast<uint16_t>( random() );
+
+        MeasureFixedHeader( fixed_header, header );
+        MeasureVariableHeader( variable_header, header );
+
+        uint32_t relative_sequence = 0;
+        for( auto j = 0; j < BENCH_BUDGET_MESSAGES; j++ )
+        {
+            if( j )
+            {
+                relative_sequence += 1 + random() % 3;
+            }
+
+            fixed_messages.Write( static_cast<uint16_t>( relative_sequence ) );
+            fixed_messages.WriteBits( nullptr, message->GetBitCount() );
+
+            variable_messages.WriteGamma( relative_sequence );
+            variable_messages.WriteBits( nullptr, message->GetBitCount() );
+        }
+    }
+
+    double header_cnt = BENCH_BUDGET_PACKETS;
+    double message_cnt = BENCH_BUDGET_PACKETS * BENCH_BUDGET_MESSAGES;
+    printf( "\nBit budget, client ids up to %d, %d messages per packet\n", BENCH_BUDGET_MAX_CLIENT_ID, BENCH_BUDGET_MESSAGES );
+    printf( "%-48s %12s %12s %10s\n", "per", "fixed", "variable", "saved" );
+    PrintBudget( "NetworkPayloadHeader", fixed_header.GetCurrentBitCount() / header_cnt, variable_header.GetCurrentBitCount() / header_cnt );
+    PrintBudget( "message (TestMessage)", fixed_messages.GetCurrentBitCount() / message_cnt, variable_messages.GetCurrentBitCount() / message_cnt );
+    PrintBudget( "packet", ( fixed_header.GetCurrentBitCount() + fixed_messages.GetCurrentBitCount() ) / header_cnt,
+                           ( variable_header.GetCurrentBitCount() + variable_messages.GetCurrentBitCount() ) / header_cnt );
+}
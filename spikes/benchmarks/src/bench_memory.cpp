@@ -0,0 +1,414 @@
+#include "pch.hpp"
+
+#include "common/engine/engine_math.hpp"
+#include "common/engine/engine_memory.hpp"
+
+#include "bench.hpp"
+
+#define BENCH_OBJECTS_PER_CHUNK   ( 512 )
+#define BENCH_ITERATION_PASSES    ( 10 )
+#define BENCH_ARENA_SIZE          ( 256 * 1024 * 1024 )
+#define BENCH_CHURN_OPERATIONS    ( 200000 )
+#define BENCH_CHURN_LIVE_MAX      ( 2048 )
+#define BENCH_THREAD_CNT          ( 4 )
+#define BENCH_THREAD_OPERATIONS   ( 1000000 )
+#define BENCH_FIRST_TOUCH_SIZE    ( 64 * 1024 * 1024 )
+
+namespace
+{
+    struct Particle
+    {
+        Engine::Vec3 position;
+        Engine::Vec3 velocity;
+        float mass;
+    };
+
+    typedef Engine::MemoryChunkAllocator<Particle, BENCH_OBJECTS_PER_CHUNK> SparseParticles;
+    typedef Engine::MemoryDenseChunkAllocator<Particle, BENCH_OBJECTS_PER_CHUNK> DenseParticles;
+
+    /* every system pass reads each live object once */
+    inline uint64_t Touch( Particle &particle )
+    {
+        return static_cast<uint64_t>( particle.position.x + particle.velocity.y + particle.mass );
+    }
+
+    /* despawn a quarter of the objects in random order, so the containers carry holes like a running game */
+    std::vector<size_t> PickDespawns( size_t count )
+    {
+        std::vector<size_t> order( count );
+        for( size_t i = 0; i < count; i++ )
+        {
+            order[ i ] = i;
+        }
+
+        std::mt19937 random( 1234 );
+        std::shuffle( order.begin(), order.end(), random );
+        order.resize( count / 4 );
+
+        return order;
+    }
+
+    void IterateListOfPointers( size_t count, std::vector<size_t> &despawns )
+    {
+        /* how MemoryChunkAllocator used to track its objects: one heap list node per object */
+        auto memory = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_ARENA_SIZE ) );
+        SparseParticles storage( memory );
+        std::vector<Particle*> objects( count );
+        std::list<Particle*> list;
+        for( size_t i = 0; i < count; i++ )
+        {
+            objects[ i ] = new( storage.Allocate() ) Particle();
+            objects[ i ]->mass = 1.0f;
+        }
+
+        std::vector<bool> dead( count, false );
+        for( auto index : despawns )
+        {
+            dead[ index ] = true;
+        }
+
+        for( size_t i = 0; i < count; i++ )
+        {
+            if( !dead[ i ] )
+            {
+                list.push_back( objects[ i ] );
+            }
+        }
+
+        auto elapsed = Bench::BestOf( BENCH_ITERATION_PASSES, [&]()
+        {
+            uint64_t sum = 0;
+            for( auto particle : list )
+            {
+                sum += Touch( *particle );
+            }
+
+            Bench::Consume( sum );
+        } );
+
+        Bench::PrintResult( "std::list<T*> pointer chase", list.size(), elapsed );
+    }
+
+    void IterateSparse( size_t count, std::vector<size_t> &despawns )
+    {
+        auto memory = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_ARENA_SIZE ) );
+        SparseParticles particles( memory );
+        std::vector<Particle*> objects( count );
+        for( size_t i = 0; i < count; i++ )
+        {
+            objects[ i ] = new( particles.Allocate() ) Particle();
+            objects[ i ]->mass = 1.0f;
+        }
+
+        for( auto index : despawns )
+        {
+            particles.Free( objects[ index ] );
+        }
+
+        auto elapsed = Bench::BestOf( BENCH_ITERATION_PASSES, [&]()
+        {
+            uint64_t sum = 0;
+            for( auto it = particles.begin(); it != particles.end(); it++ )
+            {
+                sum += Touch( *it );
+            }
+
+            Bench::Consume( sum );
+        } );
+
+        Bench::PrintResult( "MemoryChunkAllocator (live bitset)", count - despawns.size(), elapsed );
+    }
+
+    void IterateDense( size_t count, std::vector<size_t> &despawns )
+    {
+        auto memory = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_ARENA_SIZE ) );
+        DenseParticles particles( memory );
+        std::vector<Engine::MemoryDenseHandle> handles( count );
+        for( size_t i = 0; i < count; i++ )
+        {
+            handles[ i ] = particles.Allocate();
+            new( particles.Get( handles[ i ] ) ) Particle();
+            particles.Get( handles[ i ] )->mass = 1.0f;
+        }
+
+        for( auto index : despawns )
+        {
+            particles.Get( handles[ index ] )->~Particle();
+            particles.Free( handles[ index ] );
+        }
+
+        auto elapsed = Bench::BestOf( BENCH_ITERATION_PASSES, [&]()
+        {
+            uint64_t sum = 0;
+            for( auto it = particles.begin(); it != particles.end(); it++ )
+            {
+                sum += Touch( *it );
+            }
+
+            Bench::Consume( sum );
+        } );
+
+        Bench::PrintResult( "MemoryDenseChunkAllocator iterator", count - despawns.size(), elapsed );
+
+        elapsed = Bench::BestOf( BENCH_ITERATION_PASSES, [&]()
+        {
+            uint64_t sum = 0;
+            particles.ForEach( [&sum]( Particle &particle )
+            {
+                sum += Touch( particle );
+            } );
+
+            Bench::Consume( sum );
+        } );
+
+        Bench::PrintResult( "MemoryDenseChunkAllocator ForEach", count - despawns.size(), elapsed );
+    }
+
+    /* a recorded sequence of mixed size allocations and out of order frees, like packets and tokens coming and going */
+    struct ChurnOperation
+    {
+        size_t size;
+        size_t slot;
+        bool is_free;
+    };
+
+    std::vector<ChurnOperation> RecordChurn()
+    {
+        std::vector<ChurnOperation> operations;
+        std::vector<size_t> live;
+        std::vector<size_t> free_slots;
+        std::mt19937 random( 4321 );
+        for( size_t slot = 0; slot < BENCH_CHURN_LIVE_MAX; slot++ )
+        {
+            free_slots.push_back( slot );
+        }
+
+        for( size_t i = 0; i < BENCH_CHURN_OPERATIONS; i++ )
+        {
+            if( !free_slots.empty()
+             && ( live.empty() || random() % 2 ) )
+            {
+                ChurnOperation operation;
+                operation.slot = free_slots.back();
+                operation.size = random() % 8 ? 16 + random() % 240 : 256 + random() % 4096;
+                operation.is_free = false;
+                free_slots.pop_back();
+                live.push_back( operation.slot );
+                operations.push_back( operation );
+            }
+            else
+            {
+                auto index = random() % live.size();
+                ChurnOperation operation;
+                operation.slot = live[ index ];
+                operation.size = 0;
+                operation.is_free = true;
+                live[ index ] = live.back();
+                live.pop_back();
+                free_slots.push_back( operation.slot );
+                operations.push_back( operation );
+            }
+        }
+
+        return operations;
+    }
+
+    template <typename ALLOCATE, typename FREE>
+    void ReplayChurn( std::vector<ChurnOperation> &operations, ALLOCATE allocate, FREE release )
+    {
+        std::vector<void*> slots( BENCH_CHURN_LIVE_MAX, nullptr );
+        for( auto &operation : operations )
+        {
+            if( operation.is_free )
+            {
+                release( slots[ operation.slot ] );
+                slots[ operation.slot ] = nullptr;
+            }
+            else
+            {
+                slots[ operation.slot ] = allocate( operation.size );
+            }
+        }
+
+        for( auto allocation : slots )
+        {
+            if( allocation )
+            {
+                release( allocation );
+            }
+        }
+    }
+
+    void HeapChurn()
+    {
+        auto operations = RecordChurn();
+
+        auto elapsed = Bench::BestOf( 3, [&]()
+        {
+            Engine::MemorySystem memory( BENCH_ARENA_SIZE, Engine::MEMORY_SYSTEM_BACKEND_STACK );
+            ReplayChurn( operations, [&]( size_t size ) { return memory.Allocate( size ); }, [&]( void *allocation ) { memory.Free( allocation ); } );
+        } );
+
+        Bench::PrintResult( "MemorySystem stack, deferred frees", operations.size(), elapsed );
+
+        Engine::MemoryHeapStatistics statistics;
+        elapsed = Bench::BestOf( 3, [&]()
+        {
+            Engine::MemorySystem memory( BENCH_ARENA_SIZE, Engine::MEMORY_SYSTEM_BACKEND_TLSF );
+            ReplayChurn( operations, [&]( size_t size ) { return memory.Allocate( size ); }, [&]( void *allocation ) { memory.Free( allocation ); } );
+            memory.GetHeapStatistics( statistics );
+        } );
+
+        Bench::PrintResult( "MemorySystem TLSF", operations.size(), elapsed );
+
+        elapsed = Bench::BestOf( 3, [&]()
+        {
+            ReplayChurn( operations, []( size_t size ) { return std::malloc( size ); }, []( void *allocation ) { std::free( allocation ); } );
+        } );
+
+        Bench::PrintResult( "std::malloc", operations.size(), elapsed );
+
+        printf( "TLSF after churn: %zu free blocks, largest %zu of %zu free bytes\n", statistics.free_block_cnt, statistics.largest_free_block, statistics.free_bytes );
+    }
+
+    /* how the networking heap would have to be shared without the thread cache: one lock around everything */
+    class LockedAllocator : public Engine::IMemoryAllocator
+    {
+    public:
+        LockedAllocator( Engine::MemoryAllocatorPtr central ) : m_central( central ) {};
+
+        void * Allocate( size_t size, Engine::MemoryTag tag )
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            return m_central->Allocate( size, tag );
+        }
+
+        void Free( void *allocation )
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_central->Free( allocation );
+        }
+
+        Engine::MemoryAllocatorStatistics GetStatistics()
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            return m_central->GetStatistics();
+        }
+
+    private:
+        Engine::MemoryAllocatorPtr m_central;
+        std::mutex m_lock;
+    };
+
+    /* every worker creates and releases packet sized blocks, holding a few at a time */
+    double ThreadedChurn( Engine::IMemoryAllocator &allocator )
+    {
+        Bench::Stopwatch watch;
+        std::vector<std::thread> workers;
+        for( size_t t = 0; t < BENCH_THREAD_CNT; t++ )
+        {
+            workers.push_back( std::thread( [&allocator, t]()
+            {
+                std::array<void*, 8> held = {};
+                std::mt19937 random( static_cast<unsigned int>( 99 + t ) );
+                for( size_t i = 0; i < BENCH_THREAD_OPERATIONS; i++ )
+                {
+                    auto &slot = held[ i % held.size() ];
+                    allocator.Free( slot );
+                    slot = allocator.Allocate( 64 + random() % 1100, Engine::MEMORY_TAG_NETWORK_PACKETS );
+                }
+
+                for( auto allocation : held )
+                {
+                    allocator.Free( allocation );
+                }
+            } ) );
+        }
+
+        for( auto &worker : workers )
+        {
+            worker.join();
+        }
+
+        return watch.ElapsedNanoseconds();
+    }
+
+    void ThreadedAllocation()
+    {
+        auto operations = BENCH_THREAD_CNT * BENCH_THREAD_OPERATIONS;
+
+        auto elapsed = Bench::BestOf( 3, [&]()
+        {
+            LockedAllocator allocator( Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_ARENA_SIZE, Engine::MEMORY_SYSTEM_BACKEND_TLSF ) ) );
+            ThreadedChurn( allocator );
+        } );
+
+        Bench::PrintResult( "MemorySystem TLSF behind one mutex", operations, elapsed );
+
+        elapsed = Bench::BestOf( 3, [&]()
+        {
+            Engine::MemoryThreadCachedAllocator allocator( Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_ARENA_SIZE, Engine::MEMORY_SYSTEM_BACKEND_TLSF ) ) );
+            ThreadedChurn( allocator );
+        } );
+
+        Bench::PrintResult( "MemoryThreadCachedAllocator over TLSF", operations, elapsed );
+    }
+
+    /* the first frame to write into a fresh arena pays for every page it touches unless startup already did */
+    void FirstTouch( const char *title, const Engine::MemoryArenaPolicy &policy )
+    {
+        Engine::MemorySetArenaPolicy( policy );
+        auto before = Engine::MemoryGetArenaStatistics();
+
+        /* read the statistics while the arena is alive, releasing it takes its bytes back off */
+        double elapsed = 0.0;
+        Engine::MemoryArenaStatistics after;
+        {
+            Engine::FrameArena arena( BENCH_FIRST_TOUCH_SIZE );
+            Bench::Stopwatch watch;
+            auto block = static_cast<byte*>( arena.Allocate( BENCH_FIRST_TOUCH_SIZE, Engine::MEMORY_TAG_UNKNOWN ) );
+            std::memset( block, 0x5a, BENCH_FIRST_TOUCH_SIZE );
+            elapsed = watch.ElapsedNanoseconds();
+            after = Engine::MemoryGetArenaStatistics();
+        }
+
+        Bench::PrintResult( title, BENCH_FIRST_TOUCH_SIZE / 4096, elapsed );
+        printf( "    %zu prefaulted bytes, %zu huge page bytes, %zu faults avoided\n", after.prefaulted_bytes - before.prefaulted_bytes, after.huge_page_bytes - before.huge_page_bytes, after.faults_avoided - before.faults_avoided );
+
+        Engine::MemoryArenaPolicy defaults = { Engine::MEMORY_HUGE_PAGES_NONE, false };
+        Engine::MemorySetArenaPolicy( defaults );
+    }
+
+    void ArenaFirstTouch()
+    {
+        FirstTouch( "Demand paged", { Engine::MEMORY_HUGE_PAGES_NONE, false } );
+        FirstTouch( "Prefaulted", { Engine::MEMORY_HUGE_PAGES_NONE, true } );
+        FirstTouch( "Transparent huge pages", { Engine::MEMORY_HUGE_PAGES_TRANSPARENT, false } );
+        FirstTouch( "Transparent huge pages, prefaulted", { Engine::MEMORY_HUGE_PAGES_TRANSPARENT, true } );
+    }
+}
+
+void Bench::RunMemoryBenchmarks()
+{
+    const size_t counts[] = { 10000, 100000, 1000000 };
+    for( auto count : counts )
+    {
+        char title[ 128 ];
+        snprintf( title, sizeof( title ), "Component iteration, %zu objects, 25%% despawned", count );
+        PrintHeader( title );
+
+        auto despawns = PickDespawns( count );
+        IterateListOfPointers( count, despawns );
+        IterateSparse( count, despawns );
+        IterateDense( count, despawns );
+    }
+
+    PrintHeader( "Heap churn, mixed sizes, out of order frees" );
+    HeapChurn();
+
+    PrintHeader( "Packet sized churn, 4 threads" );
+    ThreadedAllocation();
+
+    PrintHeader( "First frame over a fresh 64 MB arena, per 4 KB page" );
+    ArenaFirstTouch();
+}
@@ -0,0 +1,122 @@
+#include "pch.hpp"
+
+#include "common/engine/engine_memory.hpp"
+
+#include "bench.hpp"
+
+#define BENCH_PACKET_COUNT        ( 2000000 )
+#define BENCH_PACKETS_IN_FLIGHT   ( 64 )
+#define BENCH_PACKET_ARENA_SIZE   ( 64 * 1024 * 1024 )
+#define BENCH_PACKET_DATA_SIZE    ( 1100 )
+
+namespace
+{
+    /* same shape as NetworkPayloadPacket, which needs the Windows networking headers to build */
+    struct PayloadHeader
+    {
+        uint64_t client_id;
+        uint16_t sequence;
+        uint16_t packet_ack_recent_sequence;
+        uint32_t packet_ack_sequence_bits;
+        uint16_t start_message;
+        std::array<byte, BENCH_PACKET_DATA_SIZE> message_data;
+    };
+
+    class SharedPayloadPacket
+    {
+    public:
+        SharedPayloadPacket() : message_bytes( 0 ) {};
+        virtual ~SharedPayloadPacket() {};
+
+        PayloadHeader header;
+        size_t message_bytes;
+    };
+
+    class PooledPayloadPacket : public Engine::MemoryRefCounted
+    {
+    public:
+        PooledPayloadPacket() : message_bytes( 0 ) {};
+
+        PayloadHeader header;
+        size_t message_bytes;
+    };
+
+    /* what NetworkPacketFactory::CreatePayload did: placement new into the networking heap, then a shared_ptr
+       with a deleter, which allocates its control block from the system heap */
+    std::shared_ptr<SharedPayloadPacket> CreateShared( Engine::MemoryAllocatorPtr &allocator, uint16_t sequence )
+    {
+        auto ptr = allocator->Allocate( sizeof( SharedPayloadPacket ), Engine::MEMORY_TAG_NETWORK_PACKETS );
+        auto packet = std::shared_ptr<SharedPayloadPacket>( new( ptr ) SharedPayloadPacket(), [allocator]( SharedPayloadPacket *p )
+        {
+            allocator->Free( p );
+        } );
+
+        packet->header.sequence = sequence;
+
+        return packet;
+    }
+
+    Engine::MemoryRefPtr<PooledPayloadPacket> CreatePooled( Engine::MemoryAllocatorPtr &allocator, uint16_t sequence )
+    {
+        auto ptr = allocator->Allocate( sizeof( PooledPayloadPacket ), Engine::MEMORY_TAG_NETWORK_PACKETS );
+        auto packet = new( ptr ) PooledPayloadPacket();
+        packet->BindAllocator( allocator.get() );
+        packet->header.sequence = sequence;
+
+        return Engine::MemoryRefPtr<PooledPayloadPacket>( packet );
+    }
+
+    /* packets are created, handed around by value a couple of times like the send path does, and released
+       once they fall out of the in flight window */
+    template <typename PACKET_PTR, typename CREATE>
+    double PacketChurn( CREATE create )
+    {
+        return Bench::BestOf( 3, [&]()
+        {
+            std::deque<PACKET_PTR> in_flight;
+            uint64_t sum = 0;
+            for( size_t i = 0; i < BENCH_PACKET_COUNT; i++ )
+            {
+                auto packet = create( static_cast<uint16_t>( i ) );
+                auto sent = packet;
+                sum += sent->header.sequence;
+                in_flight.push_back( std::move( packet ) );
+                if( in_flight.size() > BENCH_PACKETS_IN_FLIGHT )
+                {
+                    in_flight.pop_front();
+                }
+            }
+
+            Bench::Consume( sum );
+        } );
+    }
+
+    void PrintPacketsPerSecond( const char *name, double nanoseconds )
+    {
+        Bench::PrintResult( name, BENCH_PACKET_COUNT, nanoseconds );
+        printf( "%-48s %12.0f packets/sec\n", "", BENCH_PACKET_COUNT / ( nanoseconds * 1e-9 ) );
+    }
+}
+
+void Bench::RunPacketBenchmarks()
+{
+    PrintHeader( "Payload packet create and release, 64 in flight" );
+
+    auto heap = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( BENCH_PACKET_ARENA_SIZE, Engine::MEMORY_SYSTEM_BACKEND_TLSF ) );
+    auto elapsed = PacketChurn<std::shared_ptr<SharedPayloadPacket>>( [&]( uint16_t sequence )
+    {
+        return CreateShared( heap, sequence );
+    } );
+
+    PrintPacketsPerSecond( "shared_ptr over MemorySystem TLSF", elapsed );
+
+    std::vector<size_t> sizes;
+    sizes.push_back( sizeof( PooledPayloadPacket ) );
+    auto pools = Engine::MemoryAllocatorPtr( new Engine::MemoryFixedSizePools( heap, sizes ) );
+    elapsed = PacketChurn<Engine::MemoryRefPtr<PooledPayloadPacket>>( [&]( uint16_t sequence )
+    {
+        return CreatePooled( pools, sequence );
+    } );
+
+    PrintPacketsPerSecond( "MemoryRefPtr over MemoryFixedSizePools", elapsed );
+}
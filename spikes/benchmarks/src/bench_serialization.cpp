@@ -0,0 +1,416 @@
+#include "pch.hpp"
+
+#include "common/engine/network/network_message.hpp"
+
+#include "bench.hpp"
+
+#define BENCH_SERIALIZATION_MESSAGES         ( 20000 )
+#define BENCH_SERIALIZATION_PASSES           ( 10 )
+#define BENCH_SERIALIZATION_ENTITIES         ( 12 )     /* five fields each, so a snapshot stays under NETWORK_MESSAGE_MAX_FIELDS */
+#define BENCH_SERIALIZATION_CHANGED_PERCENT  ( 10 )
+#define BENCH_SERIALIZATION_ARENA_SIZE       ( 256 * 1024 * 1024 )
+
+namespace
+{
+    /* a few small fields, like an input or an ack */
+    class ControlMessage : public Engine::NetworkMessageSerializer<ControlMessage>
+    {
+    public:
+        static const bool FIXED_SIZE = true;
+
+        ControlMessage() : NetworkMessageSerializer( Engine::MESSAGE_TEST ), command( 0 ), target( 0 ), confirmed( false ) {};
+
+        SERIALIZE_MAPPING()
+        {
+            stream.template WriteInt<0, 15>( command );
+            stream.Write( target, 14 );
+            stream.Write( confirmed );
+        }
+
+        uint8_t command;
+        uint16_t target;
+        bool confirmed;
+    };
+
+    /* the state of a group of entities, sent as a delta once a baseline is acked */
+    class SnapshotMessage : public Engine::NetworkMessageSerializer<SnapshotMessage>
+    {
+    public:
+        struct Entity
+        {
+            uint16_t entity_id;
+            Engine::Vec3 position;
+            Engine::Quat rotation;
+            uint8_t health;
+            bool alive;
+        };
+
+        static const bool FIXED_SIZE = true;
+
+        SnapshotMessage() : NetworkMessageSerializer( Engine::MESSAGE_TEST ) {};
+
+        bool GetBaselineKey( uint32_t &key ) override { key = 0; return true; }
+
+        SERIALIZE_MAPPING()
+        {
+            static const Engine::FloatQuantization position_quantization( -1024.0f, 1024.0f, 0.01f );
+            for( auto &entity : entities )
+            {
+                stream.template WriteInt<0, 16383>( entity.entity_id );
+                stream.Write( entity.position, position_quantization );
+                stream.Write( entity.rotation );
+                stream.Write( entity.health, 7 );
+                stream.Write( entity.alive );
+            }
+        }
+
+        std::array<Entity, BENCH_SERIALIZATION_ENTITIES> entities;
+    };
+
+    /* odd widths, so nearly every field straddles a byte and many straddle a word */
+    class UnalignedMessage : public Engine::NetworkMessageSerializer<UnalignedMessage>
+    {
+    public:
+        static const bool FIXED_SIZE = true;
+
+        UnalignedMessage() : NetworkMessageSerializer( Engine::MESSAGE_TEST ) { values.fill( 0 ); };
+
+        SERIALIZE_MAPPING()
+        {
+            for( size_t i = 0; i < values.size(); i++ )
+            {
+                stream.Write( values[ i ], WIDTHS[ i % WIDTHS.size() ] );
+            }
+        }
+
+        static constexpr std::array<uint32_t, 8> WIDTHS = { 1, 3, 7, 13, 31, 33, 57, 63 };
+        std::array<uint64_t, 24> values;
+    };
+
+    constexpr std::array<uint32_t, 8> UnalignedMessage::WIDTHS;
+
+    void Randomize( ControlMessage &message, std::mt19937 &random )
+    {
+        message.command = random() % 16;
+        message.target = random() % ( 1 << 14 );
+        message.confirmed = ( random() & 1 ) != 0;
+    }
+
+    void Randomize( SnapshotMessage::Entity &entity, std::mt19937 &random )
+    {
+        std::uniform_real_distribution<float> position( -1000.0f, 1000.0f );
+        std::uniform_real_distribution<float> component( -1.0f, 1.0f );
+        entity.position = Engine::Vec3( position( random ), position( random ), position( random ) );
+
+        float x = component( random ), y = component( random ), z = component( random ), w = component( random );
+        float length = std::sqrt( x * x + y * y + z * z + w * w );
+        entity.rotation = Engine::Quat( x / length, y / length, z / length, w / length );
+        entity.health = random() % 128;
+        entity.alive = ( random() & 1 ) != 0;
+    }
+
+    void Randomize( SnapshotMessage &message, std::mt19937 &random )
+    {
+        for( size_t i = 0; i < message.entities.size(); i++ )
+        {
+            message.entities[ i ].entity_id = static_cast<uint16_t>( i );
+            Randomize( message.entities[ i ], random );
+        }
+    }
+
+    void Randomize( UnalignedMessage &message, std::mt19937 &random )
+    {
+        for( size_t i = 0; i < message.values.size(); i++ )
+        {
+            auto width = UnalignedMessage::WIDTHS[ i % UnalignedMessage::WIDTHS.size() ];
+            auto value = ( static_cast<uint64_t>( random() ) << 32 ) | random();
+            message.values[ i ] = width < 64 ? value & ( ( static_cast<uint64_t>( 1 ) << width ) - 1 ) : value;
+        }
+    }
+
+    template <typename MESSAGE>
+    std::vector<MESSAGE> MakeMessages( std::mt19937 &random )
+    {
+        std::vector<MESSAGE> messages( BENCH_SERIALIZATION_MESSAGES );
+        for( auto &message : messages )
+        {
+            Randomize( message, random );
+        }
+
+        return messages;
+    }
+
+    /* each snapshot moves a few entities on from the one before it, which is its baseline */
+    std::vector<SnapshotMessage> MakeSnapshotSequence( std::mt19937 &random )
+    {
+        std::vector<SnapshotMessage> messages( BENCH_SERIALIZATION_MESSAGES );
+        Randomize( messages.front(), random );
+        for( size_t i = 1; i < messages.size(); i++ )
+        {
+            messages[ i ] = messages[ i - 1 ];
+            for( auto &entity : messages[ i ].entities )
+            {
+                if( random() % 100 < BENCH_SERIALIZATION_CHANGED_PERCENT )
+                {
+                    Randomize( entity, random );
+                }
+            }
+        }
+
+        return messages;
+    }
+
+    void PrintRow( const char *name, size_t message_cnt, size_t bits, double nanoseconds, size_t allocation_cnt )
+    {
+        printf( "%-48s %12.1f %12.3f %12.3f %12.3f\n", name, static_cast<double>( bits ) / message_cnt, nanoseconds / message_cnt, bits / nanoseconds,
+                static_cast<double>( allocation_cnt ) / ( message_cnt * BENCH_SERIALIZATION_PASSES ) );
+    }
+
+    /* times the best of several passes and counts the allocations made over all of them */
+    /* quantized fields come back within their resolution, everything else comes back exactly */
+    bool Matches( ControlMessage &a, ControlMessage &b )
+    {
+        return a.command == b.command
+            && a.target == b.target
+            && a.confirmed == b.confirmed;
+    }
+
+    bool Matches( SnapshotMessage &a, SnapshotMessage &b )
+    {
+        for( size_t i = 0; i < a.entities.size(); i++ )
+        {
+            auto &x = a.entities[ i ];
+            auto &y = b.entities[ i ];
+            float dot = x.rotation.x * y.rotation.x + x.rotation.y * y.rotation.y + x.rotation.z * y.rotation.z + x.rotation.w * y.rotation.w;
+            if( x.entity_id != y.entity_id
+             || std::fabs( x.position.x - y.position.x ) > 0.01f
+             || std::fabs( x.position.y - y.position.y ) > 0.01f
+             || std::fabs( x.position.z - y.position.z ) > 0.01f
+             || std::fabs( dot ) < 0.999f
+             || x.health != y.health
+             || x.alive != y.alive )
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool Matches( UnalignedMessage &a, UnalignedMessage &b )
+    {
+        return a.values == b.values;
+    }
+
+    /* timings mean nothing if the messages don't come back, so a mismatch stops the run */
+    void CheckRoundTrip( const char *name, bool matches )
+    {
+        if( !matches )
+        {
+            fprintf( stderr, "%s did not read back the message it wrote\n", name );
+            std::exit( 1 );
+        }
+    }
+
+    template <typename FUNC>
+    void RunRow( const char *name, size_t message_cnt, size_t &bits, FUNC func )
+    {
+        auto allocations_before = Bench::GetAllocationCount();
+        auto elapsed = Bench::BestOf( BENCH_SERIALIZATION_PASSES, func );
+        PrintRow( name, message_cnt, bits, elapsed, Bench::GetAllocationCount() - allocations_before );
+    }
+
+    template <typename MESSAGE>
+    void RunMessageMix( const char *title, std::vector<MESSAGE> &messages )
+    {
+        printf( "\n%s, %d messages\n", title, BENCH_SERIALIZATION_MESSAGES );
+        printf( "%-48s %12s %12s %12s %12s\n", "benchmark", "bits/msg", "ns/msg", "bits/ns", "allocs/msg" );
+
+        /* measured through the base class as the endpoint does, or the optimizer folds fixed sizes into a constant */
+        std::vector<Engine::NetworkMessage*> base_messages;
+        for( auto &message : messages )
+        {
+            base_messages.push_back( &message );
+        }
+
+        size_t bits = 0;
+        RunRow( "MeasureBitStream", messages.size(), bits, [&]()
+        {
+            Engine::MeasureBitStream measure;
+            for( auto message : base_messages )
+            {
+                message->Serialize( measure );
+            }
+
+            bits = measure.GetCurrentBitCount();
+            Bench::Consume( bits );
+        } );
+
+        std::vector<byte> buffer( ( bits + 7 ) / 8 + sizeof( uint64_t ) );
+        RunRow( "OutputBitStream, caller's buffer", messages.size(), bits, [&]()
+        {
+            Engine::OutputBitStream write( buffer.data(), buffer.size() );
+            for( auto &message : messages )
+            {
+                message.Serialize( write );
+            }
+
+            write.Flush();
+        } );
+
+        /* an owned stream starts empty and grows as it goes */
+        auto arena = std::make_shared<Engine::FrameArena>( BENCH_SERIALIZATION_ARENA_SIZE );
+        size_t arena_allocation_cnt = 0;
+        auto allocations_before = Bench::GetAllocationCount();
+        auto elapsed = Bench::BestOf( BENCH_SERIALIZATION_PASSES, [&]()
+        {
+            {
+                Engine::OutputBitStream write( arena );
+                for( auto &message : messages )
+                {
+                    message.Serialize( write );
+                }
+
+                Bench::Consume( write.Collapse() );
+            }
+
+            arena_allocation_cnt += arena->GetStatistics().allocation_cnt;
+            arena->Reset();
+        } );
+
+        PrintRow( "OutputBitStream, owned and growing", messages.size(), bits, elapsed, Bench::GetAllocationCount() - allocations_before + arena_allocation_cnt );
+
+        std::vector<MESSAGE> read_back( messages.size() );
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            for( size_t i = 0; i < read_back.size(); i++ )
+            {
+                read_back[ i ].Serialize( read );
+                CheckRoundTrip( title, Matches( messages[ i ], read_back[ i ] ) );
+            }
+        }
+
+        RunRow( "InputBitStream", messages.size(), bits, [&]()
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            for( auto &message : read_back )
+            {
+                message.Serialize( read );
+            }
+
+            Bench::Consume( read.HasError() );
+        } );
+    }
+
+    void RunFactoryDecode()
+    {
+        printf( "\nNetworkMessageFactory decode, %d messages\n", BENCH_SERIALIZATION_MESSAGES );
+        printf( "%-48s %12s %12s %12s %12s\n", "benchmark", "bits/msg", "ns/msg", "bits/ns", "allocs/msg" );
+
+        auto message = Engine::NetworkMessageFactory::CreateMessage( Engine::MESSAGE_TEST );
+        size_t bits = BENCH_SERIALIZATION_MESSAGES * message->GetBitCount();
+        std::vector<byte> buffer( ( bits + 7 ) / 8 + sizeof( uint64_t ) );
+        {
+            Engine::OutputBitStream write( buffer.data(), buffer.size() );
+            for( auto i = 0; i < BENCH_SERIALIZATION_MESSAGES; i++ )
+            {
+                message->Serialize( write );
+            }
+        }
+
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            auto decoded = Engine::NetworkMessageFactory::CreateMessage( read );
+
+            /* TestMessage keeps its fields to itself, so compare what the two write */
+            Engine::OutputBitStream expected;
+            Engine::OutputBitStream actual;
+            message->Serialize( expected );
+            if( decoded )
+            {
+                decoded->Serialize( actual );
+            }
+
+            CheckRoundTrip( "NetworkMessageFactory", decoded
+                                                  && expected.GetCurrentBitCount() == actual.GetCurrentBitCount()
+                                                  && !std::memcmp( expected.GetBuffer(), actual.GetBuffer(), expected.GetSize() ) );
+        }
+
+        RunRow( "CreateMessage( InputBitStream& )", BENCH_SERIALIZATION_MESSAGES, bits, [&]()
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            for( auto i = 0; i < BENCH_SERIALIZATION_MESSAGES; i++ )
+            {
+                auto decoded = Engine::NetworkMessageFactory::CreateMessage( read );
+                Bench::Consume( decoded != nullptr );
+            }
+        } );
+    }
+
+    void RunSnapshotDeltas( std::mt19937 &random )
+    {
+        printf( "\nSnapshotMessage delta against the one before it, %d%% of entities changed, %d messages\n", BENCH_SERIALIZATION_CHANGED_PERCENT, BENCH_SERIALIZATION_MESSAGES );
+        printf( "%-48s %12s %12s %12s %12s\n", "benchmark", "bits/msg", "ns/msg", "bits/ns", "allocs/msg" );
+
+        /* each baseline records its fields once, as the endpoint does when a message is acked */
+        auto messages = MakeSnapshotSequence( random );
+        std::vector<Engine::NetworkMessageBaselinePtr> baselines;
+        for( auto &message : messages )
+        {
+            baselines.push_back( Engine::NetworkMessageBaselinePtr( new Engine::NetworkMessageBaseline( message ) ) );
+        }
+
+        std::vector<byte> buffer( messages.size() * sizeof( SnapshotMessage ) );
+        size_t bits = 0;
+        RunRow( "OutputBitStream delta", messages.size() - 1, bits, [&]()
+        {
+            Engine::OutputBitStream write( buffer.data(), buffer.size() );
+            for( size_t i = 1; i < messages.size(); i++ )
+            {
+                messages[ i ].Serialize( write, *baselines[ i - 1 ] );
+            }
+
+            write.Flush();
+            bits = write.GetCurrentBitCount();
+        } );
+
+        std::vector<SnapshotMessage> read_back( messages.size() );
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            for( size_t i = 1; i < read_back.size(); i++ )
+            {
+                read_back[ i ].Serialize( read, *baselines[ i - 1 ] );
+                CheckRoundTrip( "SnapshotMessage delta", Matches( messages[ i ], read_back[ i ] ) );
+            }
+        }
+
+        RunRow( "InputBitStream delta", messages.size() - 1, bits, [&]()
+        {
+            Engine::InputBitStream read( buffer.data(), buffer.size() );
+            for( size_t i = 1; i < read_back.size(); i++ )
+            {
+                read_back[ i ].Serialize( read, *baselines[ i - 1 ] );
+            }
+
+            Bench::Consume( read.HasError() );
+        } );
+
+    }
+}
+
+void Bench::RunSerializationBenchmarks()
+{
+    std::mt19937 random( 17 );
+
+    auto control = MakeMessages<ControlMessage>( random );
+    RunMessageMix( "ControlMessage", control );
+
+    auto snapshots = MakeMessages<SnapshotMessage>( random );
+    RunMessageMix( "SnapshotMessage", snapshots );
+
+    auto unaligned = MakeMessages<UnalignedMessage>( random );
+    RunMessageMix( "UnalignedMessage", unaligned );
+
+    RunFactoryDecode();
+    RunSnapshotDeltas( random );
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+namespace Bench
+{
+    class Stopwatch
+    {
+    public:
+        Stopwatch() : m_start( std::chrono::high_resolution_clock::now() ) {};
+
+        inline double ElapsedNanoseconds()
+        {
+            auto elapsed = std::chrono::high_resolution_clock::now() - m_start;
+            return static_cast<double>( std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
+        }
+
+    private:
+        std::chrono::high_resolution_clock::time_point m_start;
+    };
+
+    /* run the work several times and keep the fastest pass, in nanoseconds */
+    template <typename FUNC>
+    double BestOf( int passes, FUNC func )
+    {
+        double best = 0.0;
+        for( auto i = 0; i < passes; i++ )
+        {
+            Stopwatch watch;
+            func();
+            auto elapsed = watch.ElapsedNanoseconds();
+            if( i == 0 || elapsed < best )
+            {
+                best = elapsed;
+            }
+        }
+
+        return best;
+    }
+
+    void PrintHeader( const char *title );
+    void PrintResult( const char *name, size_t count, double nanoseconds );
+
+    /* keeps the optimizer from discarding benchmark results */
+    void Consume( uint64_t value );
+
+    /* heap allocations made through new since the program started */
+    size_t GetAllocationCount();
+
+    void RunMemoryBenchmarks();
+    void RunPacketBenchmarks();
+    void RunBitStreamBenchmarks();
+    void RunSerializationBenchmarks();
+    void RunBitBudgetReport();
+}
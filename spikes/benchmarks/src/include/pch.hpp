@@ -0,0 +1,88 @@
+#pragma once
+
+/* The engine sources are written against the Windows SDK.  On other platforms this header supplies the
+   handful of SDK types and macros they use so the benchmarks can build stand-alone. */
+
+#if defined( _WIN32 )
+
+#define NOMINMAX
+
+#include <SDKDDKVer.h>
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <windows.h>
+#include <comdef.h>
+
+#else
+
+#include <cstdint>
+#include <cstring>
+
+#define interface struct
+
+typedef unsigned char byte;
+typedef unsigned char boolean;
+typedef long HRESULT;
+
+#define FAILED( hr ) ( ( (HRESULT)( hr ) ) < 0 )
+#define ZeroMemory( destination, length ) std::memset( ( destination ), 0, ( length ) )
+
+struct sockaddr
+{
+    unsigned short sa_family;
+    char sa_data[ 14 ];
+};
+
+class _com_error
+{
+public:
+    _com_error( HRESULT hr ) : m_hr( hr ) {}
+    const wchar_t * ErrorMessage() const { return L"COM error"; }
+
+private:
+    HRESULT m_hr;
+};
+
+#endif
+
+/* sizes from libsodium's IETF ChaCha20-Poly1305, so the network headers build without linking sodium */
+#if !defined( crypto_aead_chacha20poly1305_IETF_KEYBYTES )
+#define crypto_aead_chacha20poly1305_IETF_KEYBYTES    ( 32U )
+#define crypto_aead_chacha20poly1305_IETF_ABYTES      ( 16U )
+#define crypto_aead_chacha20poly1305_IETF_NPUBBYTES   ( 12U )
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <codecvt>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <list>
+#include <locale>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if !defined( _WIN32 )
+/* glibc's <endian.h> defines these too, network_platform.hpp brings its own */
+#undef LITTLE_ENDIAN
+#undef BIG_ENDIAN
+#endif
@@ -0,0 +1,102 @@
+#include "pch.hpp"
+
+#include "common/engine/engine_utilities.hpp"
+
+#include "bench.hpp"
+
+static uint64_t s_sink = 0;
+static std::atomic<size_t> s_allocation_cnt( 0 );
+
+/* counts every heap allocation made through new, so benchmarks can report allocations per operation */
+void * operator new( size_t size )
+{
+    s_allocation_cnt.fetch_add( 1, std::memory_order_relaxed );
+    auto allocation = std::malloc( size ? size : 1 );
+    if( !allocation )
+    {
+        throw std::bad_alloc();
+    }
+
+    return allocation;
+}
+
+void * operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void *allocation ) noexcept
+{
+    std::free( allocation );
+}
+
+void operator delete[]( void *allocation ) noexcept
+{
+    std::free( allocation );
+}
+
+void operator delete( void *allocation, size_t ) noexcept
+{
+    std::free( allocation );
+}
+
+void operator delete[]( void *allocation, size_t ) noexcept
+{
+    std::free( allocation );
+}
+
+void Bench::PrintHeader( const char *title )
+{
+    printf( "\n%s\n", title );
+    printf( "%-48s %12s %14s\n", "benchmark", "count", "ns/element" );
+}
+
+void Bench::PrintResult( const char *name, size_t count, double nanoseconds )
+{
+    printf( "%-48s %12zu %14.3f\n", name, count, nanoseconds / static_cast<double>( count ) );
+}
+
+void Bench::Consume( uint64_t value )
+{
+    s_sink += value;
+}
+
+size_t Bench::GetAllocationCount()
+{
+    return s_allocation_cnt.load( std::memory_order_relaxed );
+}
+
+int main( int argc, char *argv[] )
+{
+    Engine::SetLogLevel( Engine::LOG_LEVEL_WARNING );
+
+    auto filter = std::string( argc > 1 ? argv[ 1 ] : "" );
+    if( filter.empty() || filter == "memory" )
+    {
+        Bench::RunMemoryBenchmarks();
+    }
+
+    if( filter.empty() || filter == "packets" )
+    {
+        Bench::RunPacketBenchmarks();
+    }
+
+    if( filter.empty() || filter == "bitstream" )
+    {
+        Bench::RunBitStreamBenchmarks();
+    }
+
+    if( filter.empty() || filter == "serialization" )
+    {
+        Bench::RunSerializationBenchmarks();
+    }
+
+    if( filter.empty() || filter == "budget" )
+    {
+        Bench::RunBitBudgetReport();
+    }
+
+    printf( "\n(sink %llu)\n", static_cast<unsigned long long>( s_sink ) );
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include "pch.hpp"
+
+#include "common/engine/engine_utilities.hpp"
+
+#if !defined( _WIN32 )
+
+/* stand-ins for the Windows only pieces of engine_utilities.cpp */
+
+static Engine::LogLevel s_log_level = Engine::LOG_LEVEL_INFO;
+
+void Engine::Log( const LogLevel level, std::wstring format, ... )
+{
+    if( level < s_log_level )
+    {
+        return;
+    }
+
+    format.append( L"\n" );
+
+    va_list args;
+    va_start( args, format );
+    vfwprintf( stderr, format.c_str(), args );
+    va_end( args );
+}
+
+void Engine::SetLogLevel( const LogLevel min_level )
+{
+    s_log_level = min_level;
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <atldef.h>
 #include <comdef.h>
 #include <ppltasks.h>	// For create_task
+#include <ppl.h>		// For parallel_for
 //#include <wrl.h>
 //#include <wrl/client.h>
 #include <dxgi1_4.h>
@@ -30,8 +31,13 @@
 #include <iostream>
 #include <map>
 #include <array>
+#include <cmath>
 #include <queue>
 #include <list>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <functional>
 
 #undef max
 
@@ -26,4 +26,18 @@ namespace Engine
         float y;
         float z;
     };
+
+    struct Quat
+    {
+        Quat() : x( 0.0f ), y( 0.0f ), z( 0.0f ), w( 1.0f ) {};
+        Quat( float _x, float _y, float _z, float _w ) : x( _x ), y( _y ), z( _z ), w( _w ) {};
+
+        bool operator == ( Quat &other ) const { return( ( x == other.x ) && ( y == other.y ) && ( z == other.z ) && ( w == other.w ) ); }
+        bool operator != ( Quat &other ) const { return( !( *this == other ) ); }
+
+        float x;
+        float y;
+        float z;
+        float w;
+    };
 }
\ No newline at end of file
@@ -3,24 +3,247 @@
 #include "engine_memory.hpp"
 #include "engine_utilities.hpp"
 
+#if defined( _WIN32 )
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_SMALL_PAGE_SIZE   ( 4 * 1024 )
+#define MEMORY_HUGE_PAGE_SIZE    ( 2 * 1024 * 1024 )
+
+namespace
+{
+    struct ThreadCacheEntry
+    {
+        uint64_t allocator_id;
+        void *cache;
+        std::shared_ptr<std::atomic<bool>> allocator_alive;
+    };
+
+    /* ids are never reused, so an allocator created at a destroyed one's address never matches its entries */
+    std::atomic<uint64_t> s_next_thread_cached_allocator_id( 1 );
+    thread_local std::vector<ThreadCacheEntry> s_thread_caches;
+
+    std::mutex s_arena_lock;
+    Engine::MemoryArenaPolicy s_arena_policy = { Engine::MEMORY_HUGE_PAGES_NONE, false };
+    Engine::MemoryArenaStatistics s_arena_statistics = { 0, 0, 0, 0 };
+
+    inline size_t RoundUp( size_t size, size_t granularity )
+    {
+        return ( size + granularity - 1 ) / granularity * granularity;
+    }
+
+    /* page faults this process has taken so far */
+    inline size_t PageFaultCount()
+    {
+#if defined( _WIN32 )
+        PROCESS_MEMORY_COUNTERS counters;
+        if( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+        {
+            return 0;
+        }
+
+        return static_cast<size_t>( counters.PageFaultCount );
+#else
+        rusage usage;
+        getrusage( RUSAGE_SELF, &usage );
+        return static_cast<size_t>( usage.ru_minflt );
+#endif
+    }
+}
+
+const wchar_t * Engine::MemoryTagName( MemoryTag tag )
+{
+    switch( tag )
+    {
+    case MEMORY_TAG_NETWORK_PACKETS:
+        return L"NetworkPackets";
+    case MEMORY_TAG_NETWORK_TOKENS:
+        return L"NetworkTokens";
+    case MEMORY_TAG_NETWORK_BUFFERS:
+        return L"NetworkBuffers";
+    case MEMORY_TAG_GAME_ENTITIES:
+        return L"GameEntities";
+    case MEMORY_TAG_GAME_COMPONENTS:
+        return L"GameComponents";
+    case MEMORY_TAG_GAME_SYSTEMS:
+        return L"GameSystems";
+    default:
+        return L"Unknown";
+    }
+}
+
+void Engine::MemorySetArenaPolicy( const MemoryArenaPolicy &policy )
+{
+    std::lock_guard<std::mutex> lock( s_arena_lock );
+    s_arena_policy = policy;
+}
+
+Engine::MemoryArenaPolicy Engine::MemoryGetArenaPolicy()
+{
+    std::lock_guard<std::mutex> lock( s_arena_lock );
+    return s_arena_policy;
+}
+
+Engine::MemoryArenaStatistics Engine::MemoryGetArenaStatistics()
+{
+    std::lock_guard<std::mutex> lock( s_arena_lock );
+    return s_arena_statistics;
+}
+
+Engine::MemoryArena Engine::MemoryReserveArena( size_t capacity )
+{
+    auto policy = MemoryGetArenaPolicy();
+    MemoryArena arena;
+    arena.base = nullptr;
+    arena.size = 0;
+    arena.huge_page_bytes = 0;
+    arena.prefaulted_bytes = 0;
+    size_t faults_avoided = 0;
+
+#if defined( _WIN32 )
+    /* windows has no transparent huge pages, both policies ask for large pages, which are always resident */
+    if( policy.huge_pages != MEMORY_HUGE_PAGES_NONE )
+    {
+        auto large_page_size = GetLargePageMinimum();
+        if( large_page_size )
+        {
+            arena.size = RoundUp( capacity, large_page_size );
+            arena.base = reinterpret_cast<byte*>( VirtualAlloc( nullptr, arena.size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE ) );
+        }
+
+        if( arena.base )
+        {
+            /* resident from the start, there are no first touch faults to count */
+            arena.huge_page_bytes = arena.size;
+        }
+        else
+        {
+            Engine::Log( Engine::LOG_LEVEL_WARNING, L"MemoryReserveArena could not get large pages (is SeLockMemoryPrivilege held?).  Using normal pages." );
+        }
+    }
+
+    if( !arena.base )
+    {
+        arena.size = RoundUp( capacity, MEMORY_SMALL_PAGE_SIZE );
+        arena.base = reinterpret_cast<byte*>( VirtualAlloc( nullptr, arena.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE ) );
+        if( !arena.base )
+        {
+            arena.size = 0;
+            return arena;
+        }
+
+        if( policy.prefault )
+        {
+            auto faults_before = PageFaultCount();
+            for( size_t offset = 0; offset < arena.size; offset += MEMORY_SMALL_PAGE_SIZE )
+            {
+                arena.base[ offset ] = 0;
+            }
+
+            faults_avoided = PageFaultCount() - faults_before;
+            arena.prefaulted_bytes = arena.size;
+        }
+    }
+#else
+    auto page_size = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+    if( policy.huge_pages == MEMORY_HUGE_PAGES_EXPLICIT )
+    {
+        arena.size = RoundUp( capacity, MEMORY_HUGE_PAGE_SIZE );
+        auto mapped = mmap( nullptr, arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if( mapped != MAP_FAILED )
+        {
+            arena.base = reinterpret_cast<byte*>( mapped );
+            arena.huge_page_bytes = arena.size;
+        }
+        else
+        {
+            Engine::Log( Engine::LOG_LEVEL_WARNING, L"MemoryReserveArena could not map explicit huge pages (check vm.nr_hugepages).  Using normal pages." );
+        }
+    }
+
+    if( !arena.base )
+    {
+        arena.size = RoundUp( capacity, page_size );
+        auto mapped = mmap( nullptr, arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( mapped == MAP_FAILED )
+        {
+            arena.size = 0;
+            return arena;
+        }
+
+        arena.base = reinterpret_cast<byte*>( mapped );
+        if( policy.huge_pages == MEMORY_HUGE_PAGES_TRANSPARENT
+         && 0 == madvise( arena.base, arena.size, MADV_HUGEPAGE ) )
+        {
+            arena.huge_page_bytes = arena.size;
+        }
+    }
+
+    if( policy.prefault )
+    {
+        /* count what the first touches actually cost, every one of them is a fault the game loop won't take */
+        auto faults_before = PageFaultCount();
+        for( size_t offset = 0; offset < arena.size; offset += page_size )
+        {
+            arena.base[ offset ] = 0;
+        }
+
+        faults_avoided = PageFaultCount() - faults_before;
+        arena.prefaulted_bytes = arena.size;
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock( s_arena_lock );
+    s_arena_statistics.reserved_bytes += arena.size;
+    s_arena_statistics.huge_page_bytes += arena.huge_page_bytes;
+    s_arena_statistics.prefaulted_bytes += arena.prefaulted_bytes;
+    s_arena_statistics.faults_avoided += faults_avoided;
+
+    return arena;
+}
+
+void Engine::MemoryReleaseArena( MemoryArena &arena )
+{
+    if( !arena.base )
+    {
+        return;
+    }
+
+#if defined( _WIN32 )
+    VirtualFree( arena.base, 0, MEM_RELEASE );
+#else
+    munmap( arena.base, arena.size );
+#endif
+
+    std::lock_guard<std::mutex> lock( s_arena_lock );
+    s_arena_statistics.reserved_bytes -= arena.size;
+    s_arena_statistics.huge_page_bytes -= arena.huge_page_bytes;
+    s_arena_statistics.prefaulted_bytes -= arena.prefaulted_bytes;
+    arena.base = nullptr;
+    arena.size = 0;
+    arena.huge_page_bytes = 0;
+    arena.prefaulted_bytes = 0;
+}
+
 Engine::MemoryStackAllocator::MemoryStackAllocator( byte *pool, size_t pool_size ) :
     m_pool( pool ),
     m_pool_size( pool_size ),
-    m_head( pool )
+    m_head( pool ),
+    m_peak_bytes( 0 ),
+    m_failed_cnt( 0 )
 {
 }
 
-void * Engine::MemoryStackAllocator::Allocate( size_t size, const wchar_t *user_name )
+void * Engine::MemoryStackAllocator::Allocate( size_t size, MemoryTag tag )
 {
     if( m_head + size > m_pool + m_pool_size )
     {
-        auto user = std::wstring( L"UNKNOWN" );
-        if( user_name == nullptr )
-        {
-            user = std::wstring( user_name );
-        }
-
-        Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryStackAllocator::Allocate was out of memory, request from %s", user.c_str() );
+        Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryStackAllocator::Allocate was out of memory, request from %s", MemoryTagName( tag ) );
+        m_failed_cnt++;
 
         return nullptr;
     }
@@ -28,6 +251,7 @@ void * Engine::MemoryStackAllocator::Allocate( size_t size, const wchar_t *user_
     m_stack.push_back( m_head );
     auto new_alloc = m_head;
     m_head += size;
+    m_peak_bytes = std::max( m_peak_bytes, GetCurrentUsed() );
 
     return new_alloc;
 }
@@ -39,118 +263,915 @@ void Engine::MemoryStackAllocator::Free( void *allocation )
     m_stack.pop_back();
 }
 
+Engine::MemoryAllocatorStatistics Engine::MemoryStackAllocator::GetStatistics()
+{
+    MemoryAllocatorStatistics statistics;
+    statistics.live_bytes = GetCurrentUsed();
+    statistics.peak_bytes = m_peak_bytes;
+    statistics.allocation_cnt = m_stack.size();
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = 0.0f;
+
+    return statistics;
+}
+
 Engine::MemoryPoolAllocator::MemoryPoolAllocator( byte *pool, size_t pool_size, size_t object_size ) :
+    m_free_list( nullptr ),
+    m_used_cnt( 0 ),
+    m_peak_cnt( 0 ),
+    m_failed_cnt( 0 ),
+    m_object_size( GetSlotSize( object_size ) ),
+    m_pool( pool ),
     m_head( pool ),
-    m_pool_size( pool_size ),
-    m_object_size( object_size )
+    m_pool_size( pool_size )
 {
-    auto max_num_objects = m_pool_size / object_size;
-    m_tail = m_head + max_num_objects * object_size;
-    m_allocations.reserve( max_num_objects );
-    m_frees.reserve( max_num_objects );
+    auto max_num_objects = m_pool_size / m_object_size;
+    m_tail = m_head + max_num_objects * m_object_size;
+
+#if defined( _DEBUG )
+    m_allocated.resize( max_num_objects, false );
+#endif
 }
 
-void * Engine::MemoryPoolAllocator::Allocate( size_t size, const wchar_t *user_name )
+void * Engine::MemoryPoolAllocator::Allocate( size_t size, MemoryTag tag )
 {
     void *address = nullptr;
-    assert( size == m_object_size );
-    if( !m_frees.empty() )
+    assert( size <= m_object_size );
+    if( m_free_list )
     {
-        address = m_frees.back();
-        m_frees.pop_back();
+        /* reuse the most recently freed slot */
+        address = m_free_list;
+        m_free_list = m_free_list->next;
     }
     else
     {
         if( m_head + m_object_size > m_tail )
         {
-            auto user = std::wstring( L"UNKNOWN" );
-            if( user_name == nullptr )
-            {
-                user = std::wstring( user_name );
-            }
-
-            Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryPoolAllocator::Allocate was out of memory, request from %s", user.c_str() );
+            Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryPoolAllocator::Allocate was out of memory, request from %s", MemoryTagName( tag ) );
+            m_failed_cnt++;
 
             return nullptr;
         }
 
+        /* slots past the head have never been handed out */
         address = m_head;
         m_head += m_object_size;
     }
 
-    m_allocations.push_back( address );
+#if defined( _DEBUG )
+    auto index = ( reinterpret_cast<byte*>( address ) - m_pool ) / m_object_size;
+    assert( !m_allocated[ index ] );
+    m_allocated[ index ] = true;
+#endif
+
+    m_used_cnt++;
+    m_peak_cnt = std::max( m_peak_cnt, m_used_cnt );
 
     return address;
 }
 
 void Engine::MemoryPoolAllocator::Free( void *allocation )
 {
-    void *found = nullptr;
-    for( auto it = m_allocations.begin(); it != m_allocations.end(); it++ )
+    assert( Owns( allocation ) );
+    assert( ( reinterpret_cast<byte*>( allocation ) - m_pool ) % m_object_size == 0 );
+
+#if defined( _DEBUG )
+    /* catch double frees */
+    auto index = ( reinterpret_cast<byte*>( allocation ) - m_pool ) / m_object_size;
+    assert( m_allocated[ index ] );
+    m_allocated[ index ] = false;
+#endif
+
+    auto slot = reinterpret_cast<FreeSlot*>( allocation );
+    slot->next = m_free_list;
+    m_free_list = slot;
+
+    assert( m_used_cnt > 0 );
+    m_used_cnt--;
+}
+
+Engine::MemoryAllocatorStatistics Engine::MemoryPoolAllocator::GetStatistics()
+{
+    /* every free slot fits every request the pool takes, so nothing is ever stranded */
+    MemoryAllocatorStatistics statistics;
+    statistics.live_bytes = GetCurrentUsed();
+    statistics.peak_bytes = m_peak_cnt * m_object_size;
+    statistics.allocation_cnt = m_used_cnt;
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = 0.0f;
+
+    return statistics;
+}
+
+Engine::MemoryTLSFAllocator::MemoryTLSFAllocator( byte *pool, size_t pool_size ) :
+    m_pool_size( pool_size ),
+    m_pool( pool ),
+    m_used_bytes( 0 ),
+    m_peak_bytes( 0 ),
+    m_allocation_cnt( 0 ),
+    m_failed_cnt( 0 ),
+    m_fl_bitmap( 0 )
+{
+    m_sl_bitmap.fill( 0 );
+    for( auto &lists : m_free_lists )
+    {
+        lists.fill( nullptr );
+    }
+
+    /* the whole pool starts as one free block, followed by a zero sized block that is never free so merging
+       never walks off the end */
+    auto start = reinterpret_cast<byte*>( ( reinterpret_cast<uintptr_t>( pool ) + ALIGN_SIZE - 1 ) & ~( ALIGN_SIZE - 1 ) );
+    auto end = reinterpret_cast<byte*>( reinterpret_cast<uintptr_t>( pool + pool_size ) & ~( ALIGN_SIZE - 1 ) );
+    assert( end > start && static_cast<size_t>( end - start ) >= 2 * BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE );
+
+    size_t max_block_size = ( static_cast<size_t>( 1 ) << FL_INDEX_MAX ) - ALIGN_SIZE;
+    auto block = reinterpret_cast<Block*>( start );
+    block->prev_physical = nullptr;
+    block->size = std::min( static_cast<size_t>( end - start ) - 2 * BLOCK_HEADER_SIZE, max_block_size );
+
+    auto sentinel = block->NextPhysical();
+    sentinel->prev_physical = block;
+    sentinel->size = 0;
+
+    InsertFreeBlock( block );
+}
+
+void * Engine::MemoryTLSFAllocator::Allocate( size_t size, MemoryTag tag )
+{
+    size_t adjusted = ( size + ALIGN_SIZE - 1 ) & ~( ALIGN_SIZE - 1 );
+    if( adjusted < BLOCK_MIN_SIZE )
+    {
+        adjusted = BLOCK_MIN_SIZE;
+    }
+
+    size_t fl;
+    size_t sl;
+    MappingSearch( adjusted, fl, sl );
+    auto block = FindSuitableBlock( fl, sl );
+    if( !block )
+    {
+        Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryTLSFAllocator::Allocate was out of memory, request from %s", MemoryTagName( tag ) );
+        m_failed_cnt++;
+
+        return nullptr;
+    }
+
+    RemoveFreeBlock( block );
+
+    /* give the tail back to the heap if it is big enough to be a block of its own */
+    auto block_size = block->GetSize();
+    if( block_size >= adjusted + BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE )
+    {
+        auto remainder = reinterpret_cast<Block*>( block->Payload() + adjusted );
+        remainder->prev_physical = block;
+        remainder->size = block_size - adjusted - BLOCK_HEADER_SIZE;
+        remainder->NextPhysical()->prev_physical = remainder;
+        block->size = adjusted;
+
+        InsertFreeBlock( remainder );
+    }
+
+    m_used_bytes += block->GetSize();
+    m_peak_bytes = std::max( m_peak_bytes, m_used_bytes );
+    m_allocation_cnt++;
+
+    return block->Payload();
+}
+
+void Engine::MemoryTLSFAllocator::Free( void *allocation )
+{
+    if( !allocation )
+    {
+        return;
+    }
+
+    auto block = reinterpret_cast<Block*>( reinterpret_cast<byte*>( allocation ) - BLOCK_HEADER_SIZE );
+    assert( !block->IsFree() );
+    assert( m_allocation_cnt > 0 );
+
+    m_used_bytes -= block->GetSize();
+    m_allocation_cnt--;
+
+    /* coalesce with free neighbours */
+    auto previous = block->prev_physical;
+    if( previous && previous->IsFree() )
+    {
+        RemoveFreeBlock( previous );
+        block = MergeBlocks( previous, block );
+    }
+
+    auto next = block->NextPhysical();
+    if( next->IsFree() )
+    {
+        RemoveFreeBlock( next );
+        block = MergeBlocks( block, next );
+    }
+
+    InsertFreeBlock( block );
+}
+
+Engine::MemoryAllocatorStatistics Engine::MemoryTLSFAllocator::GetStatistics()
+{
+    MemoryAllocatorStatistics statistics;
+    statistics.live_bytes = m_used_bytes;
+    statistics.peak_bytes = m_peak_bytes;
+    statistics.allocation_cnt = m_allocation_cnt;
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = GetHeapStatistics().fragmentation;
+
+    return statistics;
+}
+
+Engine::MemoryHeapStatistics Engine::MemoryTLSFAllocator::GetHeapStatistics()
+{
+    MemoryHeapStatistics statistics;
+    statistics.used_bytes = m_used_bytes;
+    statistics.free_bytes = 0;
+    statistics.largest_free_block = 0;
+    statistics.free_block_cnt = 0;
+    statistics.allocation_cnt = m_allocation_cnt;
+
+    for( size_t fl = 0; fl < FL_INDEX_COUNT; fl++ )
     {
-        if( *it == allocation )
+        if( !( m_fl_bitmap & ( 1u << fl ) ) )
         {
-            found = allocation;
-            m_allocations.erase( it );
-            break;
+            continue;
+        }
+
+        for( size_t sl = 0; sl < SL_INDEX_COUNT; sl++ )
+        {
+            for( auto block = m_free_lists[ fl ][ sl ]; block; block = block->next_free )
+            {
+                statistics.free_bytes += block->GetSize();
+                statistics.largest_free_block = std::max( statistics.largest_free_block, block->GetSize() );
+                statistics.free_block_cnt++;
+            }
+        }
+    }
+
+    statistics.fragmentation = 0.0f;
+    if( statistics.free_bytes )
+    {
+        statistics.fragmentation = 1.0f - static_cast<float>( statistics.largest_free_block ) / static_cast<float>( statistics.free_bytes );
+    }
+
+    return statistics;
+}
+
+void Engine::MemoryTLSFAllocator::MappingInsert( size_t size, size_t &fl, size_t &sl )
+{
+    if( size < SMALL_BLOCK_SIZE )
+    {
+        /* small blocks are all kept in the first list, split linearly */
+        fl = 0;
+        sl = size / ( SMALL_BLOCK_SIZE / SL_INDEX_COUNT );
+        return;
+    }
+
+    size_t msb = MemoryHighestSetBit( size );
+    sl = ( size >> ( msb - SL_INDEX_COUNT_LOG2 ) ) ^ SL_INDEX_COUNT;
+    fl = msb - ( FL_INDEX_SHIFT - 1 );
+}
+
+void Engine::MemoryTLSFAllocator::MappingSearch( size_t size, size_t &fl, size_t &sl )
+{
+    /* round up to the next list so any block found there is big enough */
+    if( size >= SMALL_BLOCK_SIZE )
+    {
+        size += ( static_cast<size_t>( 1 ) << ( MemoryHighestSetBit( size ) - SL_INDEX_COUNT_LOG2 ) ) - 1;
+    }
+
+    MappingInsert( size, fl, sl );
+}
+
+Engine::MemoryTLSFAllocator::Block * Engine::MemoryTLSFAllocator::FindSuitableBlock( size_t &fl, size_t &sl )
+{
+    if( fl >= FL_INDEX_COUNT )
+    {
+        return nullptr;
+    }
+
+    /* first look in the requested first level list, then in any larger one */
+    uint32_t sl_map = m_sl_bitmap[ fl ] & ( ~0u << sl );
+    if( !sl_map )
+    {
+        uint32_t fl_map = m_fl_bitmap & ( ~0u << ( fl + 1 ) );
+        if( !fl_map )
+        {
+            return nullptr;
+        }
+
+        fl = MemoryLowestSetBit( fl_map );
+        sl_map = m_sl_bitmap[ fl ];
+    }
+
+    sl = MemoryLowestSetBit( sl_map );
+
+    return m_free_lists[ fl ][ sl ];
+}
+
+void Engine::MemoryTLSFAllocator::InsertFreeBlock( Block *block )
+{
+    size_t fl;
+    size_t sl;
+    MappingInsert( block->GetSize(), fl, sl );
+
+    auto &head = m_free_lists[ fl ][ sl ];
+    block->next_free = head;
+    block->prev_free = nullptr;
+    if( head )
+    {
+        head->prev_free = block;
+    }
+
+    head = block;
+    block->size |= BLOCK_FREE_BIT;
+
+    m_fl_bitmap |= 1u << fl;
+    m_sl_bitmap[ fl ] |= 1u << sl;
+}
+
+void Engine::MemoryTLSFAllocator::RemoveFreeBlock( Block *block )
+{
+    size_t fl;
+    size_t sl;
+    MappingInsert( block->GetSize(), fl, sl );
+
+    if( block->prev_free )
+    {
+        block->prev_free->next_free = block->next_free;
+    }
+
+    if( block->next_free )
+    {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    auto &head = m_free_lists[ fl ][ sl ];
+    if( head == block )
+    {
+        head = block->next_free;
+        if( !head )
+        {
+            m_sl_bitmap[ fl ] &= ~( 1u << sl );
+            if( !m_sl_bitmap[ fl ] )
+            {
+                m_fl_bitmap &= ~( 1u << fl );
+            }
+        }
+    }
+
+    block->size &= ~BLOCK_FREE_BIT;
+}
+
+Engine::MemoryTLSFAllocator::Block * Engine::MemoryTLSFAllocator::MergeBlocks( Block *first, Block *second )
+{
+    assert( first->NextPhysical() == second );
+    first->size = first->GetSize() + BLOCK_HEADER_SIZE + second->GetSize();
+    first->NextPhysical()->prev_physical = first;
+
+    return first;
+}
+
+Engine::MemoryThreadCachedAllocator::MemoryThreadCachedAllocator( MemoryAllocatorPtr central ) :
+    m_central( central ),
+    m_id( s_next_thread_cached_allocator_id++ ),
+    m_alive( std::make_shared<std::atomic<bool>>( true ) )
+{
+}
+
+Engine::MemoryThreadCachedAllocator::~MemoryThreadCachedAllocator()
+{
+    /* every thread's entry for this allocator goes stale here, and is dropped on that thread's next lookup */
+    m_alive->store( false );
+    for( auto cache : m_caches )
+    {
+        for( auto &tag_magazines : cache->magazines )
+        {
+            for( auto &magazine : tag_magazines )
+            {
+                DrainMagazine( magazine, magazine.count );
+            }
+        }
+
+        delete cache;
+    }
+}
+
+void * Engine::MemoryThreadCachedAllocator::Allocate( size_t size, MemoryTag tag )
+{
+    auto size_class = GetSizeClass( size );
+    if( size_class == SIZE_CLASS_UNCACHED )
+    {
+        std::lock_guard<std::mutex> lock( m_central_lock );
+        auto raw = reinterpret_cast<byte*>( m_central->Allocate( BLOCK_HEADER_SIZE + size, tag ) );
+        if( !raw )
+        {
+            return nullptr;
+        }
+
+        reinterpret_cast<BlockHeader*>( raw )->size_class = SIZE_CLASS_UNCACHED;
+        reinterpret_cast<BlockHeader*>( raw )->tag = tag;
+        return raw + BLOCK_HEADER_SIZE;
+    }
+
+    assert( tag < MEMORY_TAG_CNT );
+    auto &magazine = GetThreadCache()->magazines[ tag ][ size_class ];
+    if( !magazine.count )
+    {
+        /* refill half a magazine under one lock */
+        std::lock_guard<std::mutex> lock( m_central_lock );
+        while( magazine.count < MAGAZINE_TRANSFER_CNT )
+        {
+            auto raw = reinterpret_cast<byte*>( m_central->Allocate( BLOCK_HEADER_SIZE + GetSizeClassBytes( size_class ), tag ) );
+            if( !raw )
+            {
+                break;
+            }
+
+            reinterpret_cast<BlockHeader*>( raw )->size_class = size_class;
+            reinterpret_cast<BlockHeader*>( raw )->tag = tag;
+            magazine.blocks[ magazine.count++ ] = raw;
+        }
+
+        if( !magazine.count )
+        {
+            return nullptr;
+        }
+    }
+
+    return magazine.blocks[ --magazine.count ] + BLOCK_HEADER_SIZE;
+}
+
+void Engine::MemoryThreadCachedAllocator::Free( void *allocation )
+{
+    if( !allocation )
+    {
+        return;
+    }
+
+    auto raw = reinterpret_cast<byte*>( allocation ) - BLOCK_HEADER_SIZE;
+    auto header = reinterpret_cast<BlockHeader*>( raw );
+    if( header->size_class == SIZE_CLASS_UNCACHED )
+    {
+        std::lock_guard<std::mutex> lock( m_central_lock );
+        m_central->Free( raw );
+        return;
+    }
+
+    assert( header->size_class < SIZE_CLASS_CNT && header->tag < MEMORY_TAG_CNT );
+    auto &magazine = GetThreadCache()->magazines[ header->tag ][ header->size_class ];
+    if( magazine.count == MAGAZINE_SIZE )
+    {
+        DrainMagazine( magazine, MAGAZINE_TRANSFER_CNT );
+    }
+
+    magazine.blocks[ magazine.count++ ] = raw;
+}
+
+Engine::MemoryAllocatorStatistics Engine::MemoryThreadCachedAllocator::GetStatistics()
+{
+    std::lock_guard<std::mutex> lock( m_central_lock );
+    return m_central->GetStatistics();
+}
+
+void Engine::MemoryThreadCachedAllocator::FlushThreadCache()
+{
+    for( auto &tag_magazines : GetThreadCache()->magazines )
+    {
+        for( auto &magazine : tag_magazines )
+        {
+            DrainMagazine( magazine, magazine.count );
+        }
+    }
+}
+
+Engine::MemoryThreadCachedAllocator::ThreadCache * Engine::MemoryThreadCachedAllocator::GetThreadCache()
+{
+    for( auto entry = s_thread_caches.begin(); entry != s_thread_caches.end(); )
+    {
+        if( !entry->allocator_alive->load() )
+        {
+            /* its allocator already drained and freed the cache */
+            entry = s_thread_caches.erase( entry );
+            continue;
+        }
+
+        if( entry->allocator_id == m_id )
+        {
+            return reinterpret_cast<ThreadCache*>( entry->cache );
+        }
+
+        entry++;
+    }
+
+    /* first use from this thread */
+    auto cache = new ThreadCache();
+    for( auto &tag_magazines : cache->magazines )
+    {
+        for( auto &magazine : tag_magazines )
+        {
+            magazine.count = 0;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_central_lock );
+        m_caches.push_back( cache );
+    }
+
+    ThreadCacheEntry entry;
+    entry.allocator_id = m_id;
+    entry.cache = cache;
+    entry.allocator_alive = m_alive;
+    s_thread_caches.push_back( entry );
+
+    return cache;
+}
+
+void Engine::MemoryThreadCachedAllocator::DrainMagazine( Magazine &magazine, size_t count )
+{
+    if( !count )
+    {
+        return;
+    }
+
+    assert( count <= magazine.count );
+    std::lock_guard<std::mutex> lock( m_central_lock );
+    for( size_t i = 0; i < count; i++ )
+    {
+        m_central->Free( magazine.blocks[ --magazine.count ] );
+    }
+}
+
+size_t Engine::MemoryThreadCachedAllocator::GetSizeClass( size_t size )
+{
+    if( size <= ( static_cast<size_t>( 1 ) << SIZE_CLASS_MIN_LOG2 ) )
+    {
+        return 0;
+    }
+
+    auto size_class = static_cast<size_t>( MemoryHighestSetBit( size - 1 ) ) + 1 - SIZE_CLASS_MIN_LOG2;
+    if( size_class >= SIZE_CLASS_CNT )
+    {
+        return SIZE_CLASS_UNCACHED;
+    }
+
+    return size_class;
+}
+
+Engine::MemoryFixedSizePools::MemoryFixedSizePools( MemoryAllocatorPtr backing, const std::vector<size_t> &object_sizes, size_t objects_per_chunk ) :
+    m_backing( backing ),
+    m_objects_per_chunk( objects_per_chunk ),
+    m_chunk_bytes( 0 ),
+    m_live_bytes( 0 ),
+    m_peak_bytes( 0 ),
+    m_allocation_cnt( 0 ),
+    m_failed_cnt( 0 )
+{
+    assert( objects_per_chunk > 0 );
+    auto sizes = object_sizes;
+    std::sort( sizes.begin(), sizes.end() );
+    sizes.erase( std::unique( sizes.begin(), sizes.end() ), sizes.end() );
+
+    for( auto object_size : sizes )
+    {
+        Pool pool;
+        pool.object_size = object_size;
+        pool.slot_size = SLOT_HEADER_SIZE + MemoryPoolAllocator::GetSlotSize( object_size );
+        pool.free_list = nullptr;
+        pool.head = nullptr;
+        pool.tail = nullptr;
+        pool.live_cnt = 0;
+        m_pools.push_back( pool );
+    }
+}
+
+Engine::MemoryFixedSizePools::~MemoryFixedSizePools()
+{
+    for( auto it = m_chunks.rbegin(); it != m_chunks.rend(); it++ )
+    {
+        m_backing->Free( *it );
+    }
+}
+
+void * Engine::MemoryFixedSizePools::Allocate( size_t size, MemoryTag tag )
+{
+    size_t pool_index = 0;
+    while( pool_index < m_pools.size()
+        && m_pools[ pool_index ].object_size < size )
+    {
+        pool_index++;
+    }
+
+    if( pool_index == m_pools.size() )
+    {
+        auto raw = reinterpret_cast<byte*>( m_backing->Allocate( SLOT_HEADER_SIZE + size, tag ) );
+        if( !raw )
+        {
+            m_failed_cnt++;
+            return nullptr;
         }
+
+        reinterpret_cast<SlotHeader*>( raw )->pool_index = POOL_INDEX_UNPOOLED;
+        reinterpret_cast<SlotHeader*>( raw )->size = size;
+        m_live_bytes += size;
+        m_peak_bytes = std::max( m_peak_bytes, m_live_bytes );
+        m_allocation_cnt++;
+
+        return raw + SLOT_HEADER_SIZE;
+    }
+
+    auto &pool = m_pools[ pool_index ];
+    byte *slot = nullptr;
+    if( pool.free_list )
+    {
+        slot = reinterpret_cast<byte*>( pool.free_list );
+        pool.free_list = pool.free_list->next;
+    }
+    else
+    {
+        if( pool.head == pool.tail )
+        {
+            auto chunk = reinterpret_cast<byte*>( m_backing->Allocate( pool.slot_size * m_objects_per_chunk, tag ) );
+            if( !chunk )
+            {
+                Engine::Log( Engine::LOG_LEVEL_ERROR, L"MemoryFixedSizePools::Allocate could not grow the pool, request from %s", MemoryTagName( tag ) );
+                m_failed_cnt++;
+                return nullptr;
+            }
+
+            m_chunks.push_back( chunk );
+            m_chunk_bytes += pool.slot_size * m_objects_per_chunk;
+            pool.head = chunk;
+            pool.tail = chunk + pool.slot_size * m_objects_per_chunk;
+        }
+
+        slot = pool.head;
+        pool.head += pool.slot_size;
     }
 
-    assert( found );
-    m_frees.push_back( allocation );
+    reinterpret_cast<SlotHeader*>( slot )->pool_index = pool_index;
+    reinterpret_cast<SlotHeader*>( slot )->size = size;
+    pool.live_cnt++;
+    m_live_bytes += size;
+    m_peak_bytes = std::max( m_peak_bytes, m_live_bytes );
+    m_allocation_cnt++;
+
+    return slot + SLOT_HEADER_SIZE;
+}
+
+void Engine::MemoryFixedSizePools::Free( void *allocation )
+{
+    if( !allocation )
+    {
+        return;
+    }
+
+    auto slot = reinterpret_cast<byte*>( allocation ) - SLOT_HEADER_SIZE;
+    auto pool_index = reinterpret_cast<SlotHeader*>( slot )->pool_index;
+    assert( m_allocation_cnt > 0 );
+    m_live_bytes -= reinterpret_cast<SlotHeader*>( slot )->size;
+    m_allocation_cnt--;
+
+    if( pool_index == POOL_INDEX_UNPOOLED )
+    {
+        m_backing->Free( slot );
+        return;
+    }
+
+    assert( pool_index < m_pools.size() );
+    auto &pool = m_pools[ pool_index ];
+    assert( pool.live_cnt > 0 );
+    pool.live_cnt--;
+
+    auto free_slot = reinterpret_cast<FreeSlot*>( slot );
+    free_slot->next = pool.free_list;
+    pool.free_list = free_slot;
+}
+
+Engine::MemoryAllocatorStatistics Engine::MemoryFixedSizePools::GetStatistics()
+{
+    size_t busy_bytes = 0;
+    for( auto &pool : m_pools )
+    {
+        busy_bytes += pool.live_cnt * pool.slot_size;
+    }
+
+    MemoryAllocatorStatistics statistics;
+    statistics.live_bytes = m_live_bytes;
+    statistics.peak_bytes = m_peak_bytes;
+    statistics.allocation_cnt = m_allocation_cnt;
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = 0.0f;
+    if( m_chunk_bytes )
+    {
+        statistics.fragmentation = 1.0f - static_cast<float>( busy_bytes ) / static_cast<float>( m_chunk_bytes );
+    }
+
+    return statistics;
+}
+
+Engine::FrameArena::FrameArena( size_t capacity ) :
+    m_pool_size( capacity ),
+    m_high_water( 0 ),
+    m_allocation_cnt( 0 ),
+    m_failed_cnt( 0 )
+{
+    m_arena = MemoryReserveArena( capacity );
+    if( !m_arena.base )
+    {
+        throw new std::runtime_error( "FrameArena could not allocate pool from system memory!" );
+    }
+
+    m_pool = m_arena.base;
+    m_head = m_pool;
+}
+
+Engine::FrameArena::~FrameArena()
+{
+    MemoryReleaseArena( m_arena );
+}
+
+void * Engine::FrameArena::Allocate( size_t size, MemoryTag tag )
+{
+    auto aligned_size = ( size + ALIGN_SIZE - 1 ) & ~( ALIGN_SIZE - 1 );
+    if( aligned_size > static_cast<size_t>( m_pool + m_pool_size - m_head ) )
+    {
+        Engine::Log( Engine::LOG_LEVEL_ERROR, L"FrameArena::Allocate was out of memory, request from %s", MemoryTagName( tag ) );
+        m_failed_cnt++;
+
+        return nullptr;
+    }
+
+    auto new_alloc = m_head;
+    m_head += aligned_size;
+    m_allocation_cnt++;
+
+    return new_alloc;
+}
+
+void Engine::FrameArena::Free( void *allocation )
+{
+    /* everything is released together on Reset */
+    assert( !allocation || ( allocation >= m_pool && allocation < m_head ) );
+}
+
+Engine::MemoryAllocatorStatistics Engine::FrameArena::GetStatistics()
+{
+    MemoryAllocatorStatistics statistics;
+    statistics.live_bytes = GetCurrentUsed();
+    statistics.peak_bytes = std::max( m_high_water, GetCurrentUsed() );
+    statistics.allocation_cnt = m_allocation_cnt;
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = 0.0f;
+
+    return statistics;
 }
 
-Engine::MemorySystem::MemorySystem( size_t capacity )
+void Engine::FrameArena::Reset()
 {
-    m_system_memory = reinterpret_cast<byte*>( std::malloc( capacity ) );
-    if( !m_system_memory )
+    m_high_water = std::max( m_high_water, GetCurrentUsed() );
+
+#if defined( _DEBUG )
+    /* make use after reset easy to spot */
+    std::memset( m_pool, 0xcd, m_head - m_pool );
+#endif
+
+    m_head = m_pool;
+    m_allocation_cnt = 0;
+}
+
+Engine::MemorySystem::MemorySystem( size_t capacity, MemorySystemBackend backend, const wchar_t *name ) :
+    m_name( name ),
+    m_capacity( capacity ),
+    m_backend( backend ),
+    m_failed_cnt( 0 )
+{
+#if defined( MEMORY_TAG_TRACKING )
+    m_live_bytes = 0;
+    m_peak_bytes = 0;
+    m_allocation_cnt = 0;
+    for( auto &tag : m_tags )
+    {
+        tag.bytes = 0;
+        tag.allocation_cnt = 0;
+        tag.high_water_bytes = 0;
+    }
+#endif
+
+    m_system_memory = MemoryReserveArena( capacity );
+    if( !m_system_memory.base )
     {
         throw new std::runtime_error( "MemorySystem could not allocate pool from system memory!" );
     }
 
-    m_allocator = MemoryAllocatorPtr( new Engine::MemoryStackAllocator( m_system_memory, capacity ) );
+    switch( m_backend )
+    {
+    case MEMORY_SYSTEM_BACKEND_TLSF:
+        m_allocator = MemoryAllocatorPtr( new Engine::MemoryTLSFAllocator( m_system_memory.base, capacity ) );
+        break;
+
+    default:
+        m_allocator = MemoryAllocatorPtr( new Engine::MemoryStackAllocator( m_system_memory.base, capacity ) );
+        break;
+    }
 }
 
 Engine::MemorySystem::~MemorySystem()
 {
-    std::free( m_system_memory );
+    /* how much of the arena this run needed, for sizing it */
+    Engine::Log( Engine::LOG_LEVEL_INFO, L"%s peaked at %zu of %zu bytes, %zu failed allocations.", m_name.c_str(), GetStatistics().peak_bytes, m_capacity, m_failed_cnt );
+    ReportLeaks();
+
+    m_allocator.reset();
+    MemoryReleaseArena( m_system_memory );
 }
 
-void * Engine::MemorySystem::Allocate( size_t size, const wchar_t *user_name )
+void * Engine::MemorySystem::Allocate( size_t size, MemoryTag tag )
 {
-    auto user = std::wstring( L"UNKNOWN" );
-    if( user_name != nullptr )
+    assert( tag < MEMORY_TAG_CNT );
+
+    /* the stack packs allocations back to back, keep the next header aligned */
+    auto padded_size = ( size + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+    auto raw = reinterpret_cast<byte*>( m_allocator->Allocate( ALLOCATION_HEADER_SIZE + padded_size, tag ) );
+    if( !raw )
+    {
+        m_failed_cnt++;
+        return nullptr;
+    }
+
+    if( m_backend == MEMORY_SYSTEM_BACKEND_STACK )
     {
-        user = std::wstring( user_name );
+        m_allocations.push_back( raw );
     }
 
-    Engine::Log( Engine::LOG_LEVEL_INFO, L"MemorySystem::Allocate %s allocated %d bytes.", user.c_str(), size );
-    auto new_allocation = m_allocator->Allocate( size, user_name );
-    m_allocations.push_back( std::make_pair( user.c_str(), new_allocation ) );
+#if defined( MEMORY_TAG_TRACKING )
+    auto header = reinterpret_cast<AllocationHeader*>( raw );
+    header->size = size;
+    header->tag = tag;
+
+    auto &counters = m_tags[ tag ];
+    counters.bytes += size;
+    counters.allocation_cnt++;
+    counters.high_water_bytes = std::max( counters.high_water_bytes, counters.bytes );
 
-    return new_allocation;
+    m_live_bytes += size;
+    m_peak_bytes = std::max( m_peak_bytes, m_live_bytes );
+    m_allocation_cnt++;
+#endif
+
+    return raw + ALLOCATION_HEADER_SIZE;
 }
 
 void Engine::MemorySystem::Free( void *allocation )
 {
-    if( allocation != m_allocations.back().second )
+    if( !allocation )
+    {
+        return;
+    }
+
+    auto raw = reinterpret_cast<byte*>( allocation ) - ALLOCATION_HEADER_SIZE;
+#if defined( MEMORY_TAG_TRACKING )
+    auto header = reinterpret_cast<AllocationHeader*>( raw );
+    auto &counters = m_tags[ header->tag ];
+    assert( counters.allocation_cnt > 0 && counters.bytes >= header->size );
+    counters.bytes -= header->size;
+    counters.allocation_cnt--;
+    m_live_bytes -= header->size;
+    m_allocation_cnt--;
+#endif
+
+    if( m_backend == MEMORY_SYSTEM_BACKEND_TLSF )
+    {
+        m_allocator->Free( raw );
+        return;
+    }
+
+    /* the stack can only release its top, so hold on to out of order frees until everything above them is gone */
+    if( m_allocations.empty()
+     || raw != m_allocations.back() )
     {
-        m_frees.push_back( allocation );
+        m_frees.push_back( raw );
         return;
     }
 
-    void *pointer_to_free = m_allocations.back().second;
+    void *pointer_to_free = m_allocations.back();
     m_allocations.pop_back();
     do
     {
         m_allocator->Free( pointer_to_free );
         pointer_to_free = nullptr;
+        if( m_allocations.empty() )
+        {
+            break;
+        }
 
         for( auto it = m_frees.begin(); it != m_frees.end(); it++ )
         {
-            if( *it == m_allocations.back().second )
+            if( *it == m_allocations.back() )
             {
-                pointer_to_free = m_allocations.back().second;
+                pointer_to_free = m_allocations.back();
                 m_allocations.pop_back();
                 m_frees.erase( it );
                 break;
@@ -158,4 +1179,106 @@ void Engine::MemorySystem::Free( void *allocation )
         }
 
     } while( pointer_to_free );
-}
\ No newline at end of file
+}
+
+Engine::MemoryAllocatorStatistics Engine::MemorySystem::GetStatistics()
+{
+    auto backend = m_allocator->GetStatistics();
+
+    MemoryAllocatorStatistics statistics;
+#if defined( MEMORY_TAG_TRACKING )
+    statistics.live_bytes = m_live_bytes;
+    statistics.peak_bytes = m_peak_bytes;
+    statistics.allocation_cnt = m_allocation_cnt;
+#else
+    /* without the headers only the backend knows the sizes, so these include its padding */
+    statistics.live_bytes = backend.live_bytes;
+    statistics.peak_bytes = backend.peak_bytes;
+    statistics.allocation_cnt = backend.allocation_cnt;
+#endif
+    statistics.failed_allocation_cnt = m_failed_cnt;
+    statistics.fragmentation = backend.fragmentation;
+
+    if( m_backend == MEMORY_SYSTEM_BACKEND_STACK
+     && !m_frees.empty() )
+    {
+        /* deferred frees are free memory the stack can't hand out until everything above them goes */
+        auto stranded_bytes = GetStrandedBytes();
+        auto free_bytes = m_capacity - backend.live_bytes + stranded_bytes;
+        statistics.fragmentation = static_cast<float>( stranded_bytes ) / static_cast<float>( free_bytes );
+
+#if !defined( MEMORY_TAG_TRACKING )
+        /* the backend still counts them as live */
+        statistics.live_bytes -= stranded_bytes;
+        statistics.allocation_cnt -= m_frees.size();
+#endif
+    }
+
+    return statistics;
+}
+
+size_t Engine::MemorySystem::ReportLeaks()
+{
+#if defined( MEMORY_TAG_TRACKING )
+    size_t leaked_cnt = 0;
+    for( size_t i = 0; i < MEMORY_TAG_CNT; i++ )
+    {
+        auto &counters = m_tags[ i ];
+        if( !counters.allocation_cnt )
+        {
+            continue;
+        }
+
+        Engine::Log( Engine::LOG_LEVEL_WARNING, L"%s leaked %zu allocations (%zu bytes) from %s", m_name.c_str(), counters.allocation_cnt, counters.bytes, MemoryTagName( static_cast<MemoryTag>( i ) ) );
+        leaked_cnt += counters.allocation_cnt;
+    }
+
+    return leaked_cnt;
+#else
+    auto statistics = GetStatistics();
+    if( statistics.allocation_cnt )
+    {
+        Engine::Log( Engine::LOG_LEVEL_WARNING, L"%s leaked %zu allocations (%zu bytes)", m_name.c_str(), statistics.allocation_cnt, statistics.live_bytes );
+    }
+
+    return statistics.allocation_cnt;
+#endif
+}
+
+#if defined( MEMORY_TAG_TRACKING )
+void Engine::MemorySystem::DumpTagStatistics()
+{
+    Engine::Log( Engine::LOG_LEVEL_INFO, L"%s tag statistics:", m_name.c_str() );
+    for( size_t i = 0; i < MEMORY_TAG_CNT; i++ )
+    {
+        auto &counters = m_tags[ i ];
+        Engine::Log( Engine::LOG_LEVEL_INFO, L"    %-20s %10zu bytes %8zu allocations %10zu high water", MemoryTagName( static_cast<MemoryTag>( i ) ), counters.bytes, counters.allocation_cnt, counters.high_water_bytes );
+    }
+}
+#endif
+
+size_t Engine::MemorySystem::GetStrandedBytes()
+{
+    /* each deferred free runs up to the allocation above it, or to the top of the stack */
+    auto top = m_system_memory.base + m_allocator->GetStatistics().live_bytes;
+    size_t stranded_bytes = 0;
+    for( auto raw : m_frees )
+    {
+        auto above = std::upper_bound( m_allocations.begin(), m_allocations.end(), raw );
+        auto end = above != m_allocations.end() ? reinterpret_cast<byte*>( *above ) : top;
+        stranded_bytes += end - reinterpret_cast<byte*>( raw );
+    }
+
+    return stranded_bytes;
+}
+
+bool Engine::MemorySystem::GetHeapStatistics( MemoryHeapStatistics &statistics )
+{
+    if( m_backend != MEMORY_SYSTEM_BACKEND_TLSF )
+    {
+        return false;
+    }
+
+    statistics = static_cast<MemoryTLSFAllocator&>( *m_allocator ).GetHeapStatistics();
+    return true;
+}
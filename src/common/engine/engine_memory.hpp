@@ -2,10 +2,73 @@
 
 namespace Engine
 {
+    inline int MemoryLowestSetBit( uint64_t value )
+    {
+        assert( value );
+#if defined( _MSC_VER )
+        unsigned long index;
+        _BitScanForward64( &index, value );
+        return static_cast<int>( index );
+#else
+        return __builtin_ctzll( value );
+#endif
+    }
+
+    inline int MemoryHighestSetBit( uint64_t value )
+    {
+        assert( value );
+#if defined( _MSC_VER )
+        unsigned long index;
+        _BitScanReverse64( &index, value );
+        return static_cast<int>( index );
+#else
+        return 63 - __builtin_clzll( value );
+#endif
+    }
+
+    /* rounds a size up to the alignment every allocator hands out */
+    inline constexpr size_t MemoryAlignUp( size_t size )
+    {
+        return ( size + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+    }
+
+    /* who an allocation belongs to, for the per-tag counters kept by MemorySystem */
+    typedef enum
+    {
+        MEMORY_TAG_UNKNOWN,
+        MEMORY_TAG_NETWORK_PACKETS,
+        MEMORY_TAG_NETWORK_TOKENS,
+        MEMORY_TAG_NETWORK_BUFFERS,
+        MEMORY_TAG_GAME_ENTITIES,
+        MEMORY_TAG_GAME_COMPONENTS,
+        MEMORY_TAG_GAME_SYSTEMS,
+        MEMORY_TAG_CNT
+    } MemoryTag;
+
+    const wchar_t * MemoryTagName( MemoryTag tag );
+
+    struct MemoryTagStatistics
+    {
+        size_t bytes;
+        size_t allocation_cnt;
+        size_t high_water_bytes;
+    };
+
+    /* the same counters from every allocator, so arenas can be sized from what a run actually used */
+    struct MemoryAllocatorStatistics
+    {
+        size_t live_bytes;
+        size_t peak_bytes;
+        size_t allocation_cnt;
+        size_t failed_allocation_cnt;
+        float fragmentation; /* share of the free memory that can't serve an arbitrary request, 0 when none is stranded */
+    };
+
     interface IMemoryAllocator
     {
-        virtual void * Allocate( size_t size, const wchar_t *user_name ) = 0;
+        virtual void * Allocate( size_t size, MemoryTag tag ) = 0;
         virtual void Free( void *allocation ) = 0;
+        virtual MemoryAllocatorStatistics GetStatistics() = 0;
     }; typedef std::shared_ptr<IMemoryAllocator> MemoryAllocatorPtr;
 
     class MemoryStackAllocator : public IMemoryAllocator
@@ -13,8 +76,9 @@ namespace Engine
     public:
         MemoryStackAllocator( byte *pool, size_t pool_size );
 
-        void * Allocate( size_t size, const wchar_t *user_name = nullptr );
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
         void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
         
         inline size_t GetCurrentUsed() { return m_head - m_pool; }
         inline size_t GetCapacity() { return m_pool_size; }
@@ -24,6 +88,8 @@ namespace Engine
         size_t m_pool_size;
         byte *m_pool;
         byte *m_head;
+        size_t m_peak_bytes;
+        size_t m_failed_cnt;
     };
 
     class MemoryPoolAllocator : public IMemoryAllocator
@@ -31,143 +97,861 @@ namespace Engine
     public:
         MemoryPoolAllocator( byte *pool, size_t pool_size, size_t object_size );
 
-        void * Allocate( size_t size, const wchar_t *user_name = nullptr );
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
         void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
 
-        inline size_t GetCurrentUsed() { return m_allocations.size() * m_object_size; }
+        inline size_t GetCurrentUsed() { return m_used_cnt * m_object_size; }
         inline size_t GetCapacity() { return m_pool_size; }
+        inline bool IsFull() { return m_free_list == nullptr && m_head == m_tail; }
+        inline bool Owns( void *allocation ) { return allocation >= m_pool && allocation < m_tail; }
+        static inline constexpr size_t GetSlotSize( size_t object_size ) { return MemoryAlignUp( object_size > sizeof( FreeSlot ) ? object_size : sizeof( FreeSlot ) ); }
 
     private:
-        std::vector<void*> m_allocations;
-        std::vector<void*> m_frees;
+        /* freed slots are threaded together through their own memory */
+        struct FreeSlot
+        {
+            FreeSlot *next;
+        };
+
+        FreeSlot *m_free_list;
+        size_t m_used_cnt;
+        size_t m_peak_cnt;
+        size_t m_failed_cnt;
         size_t m_object_size;
+        byte *m_pool;
         byte *m_head;
         byte *m_tail;
         size_t m_pool_size;
+
+#if defined( _DEBUG )
+        std::vector<bool> m_allocated;
+#endif
+    };
+
+    struct MemoryHeapStatistics
+    {
+        size_t used_bytes;
+        size_t free_bytes;
+        size_t largest_free_block;
+        size_t free_block_cnt;
+        size_t allocation_cnt;
+        float fragmentation; /* 0 when all free memory is one block, approaching 1 as it splinters */
+    };
+
+    /* Two-level segregated fit heap.  Free blocks are binned by size into first level (power of two) and
+       second level (linear subdivision) lists with a bitmap per level, so both Allocate and Free are
+       constant time, and neighbouring free blocks are merged on Free. */
+    class MemoryTLSFAllocator : public IMemoryAllocator
+    {
+    public:
+        MemoryTLSFAllocator( byte *pool, size_t pool_size );
+
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
+        void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
+
+        inline size_t GetCurrentUsed() { return m_used_bytes; }
+        inline size_t GetCapacity() { return m_pool_size; }
+        MemoryHeapStatistics GetHeapStatistics();
+
+    private:
+        static const size_t ALIGN_SIZE_LOG2 = 4;
+        static const size_t ALIGN_SIZE = 1 << ALIGN_SIZE_LOG2;
+        static const size_t SL_INDEX_COUNT_LOG2 = 5;
+        static const size_t SL_INDEX_COUNT = 1 << SL_INDEX_COUNT_LOG2;
+        static const size_t FL_INDEX_MAX = 32;
+        static const size_t FL_INDEX_SHIFT = SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2;
+        static const size_t FL_INDEX_COUNT = FL_INDEX_MAX - FL_INDEX_SHIFT + 1;
+        static const size_t SMALL_BLOCK_SIZE = 1 << FL_INDEX_SHIFT;
+
+        struct Block
+        {
+            Block *prev_physical;
+            size_t size;      /* payload bytes; the low bit flags a free block */
+
+            /* only valid while the block is free, overlaps the payload */
+            Block *next_free;
+            Block *prev_free;
+
+            inline size_t GetSize() { return size & ~BLOCK_FREE_BIT; }
+            inline bool IsFree() { return ( size & BLOCK_FREE_BIT ) != 0; }
+            inline byte * Payload() { return reinterpret_cast<byte*>( this ) + BLOCK_HEADER_SIZE; }
+            inline Block * NextPhysical() { return reinterpret_cast<Block*>( Payload() + GetSize() ); }
+        };
+
+        static const size_t BLOCK_FREE_BIT = 1;
+        static const size_t BLOCK_HEADER_SIZE = 2 * sizeof( void* );
+        static const size_t BLOCK_MIN_SIZE = 2 * sizeof( void* );
+
+        size_t m_pool_size;
+        byte *m_pool;
+        size_t m_used_bytes;
+        size_t m_peak_bytes;
+        size_t m_allocation_cnt;
+        size_t m_failed_cnt;
+        uint32_t m_fl_bitmap;
+        std::array<uint32_t, FL_INDEX_COUNT> m_sl_bitmap;
+        std::array<std::array<Block*, SL_INDEX_COUNT>, FL_INDEX_COUNT> m_free_lists;
+
+        static void MappingInsert( size_t size, size_t &fl, size_t &sl );
+        static void MappingSearch( size_t size, size_t &fl, size_t &sl );
+        Block * FindSuitableBlock( size_t &fl, size_t &sl );
+        void InsertFreeBlock( Block *block );
+        void RemoveFreeBlock( Block *block );
+        Block * MergeBlocks( Block *first, Block *second );
+    };
+
+    typedef enum
+    {
+        MEMORY_HUGE_PAGES_NONE,
+        MEMORY_HUGE_PAGES_TRANSPARENT, /* ask the kernel to back the arena with huge pages when it can */
+        MEMORY_HUGE_PAGES_EXPLICIT     /* reserved huge pages, falls back to normal pages if none are available */
+    } MemoryHugePages;
+
+    /* how arenas get their pages from the OS, chosen once at startup */
+    struct MemoryArenaPolicy
+    {
+        MemoryHugePages huge_pages;
+        bool prefault;                 /* touch every page up front rather than faulting mid-game */
+    };
+
+    struct MemoryArenaStatistics
+    {
+        size_t reserved_bytes;
+        size_t huge_page_bytes;
+        size_t prefaulted_bytes;
+        size_t faults_avoided;         /* page faults measured while prefaulting, each one the game loop won't take; a running total */
     };
 
+    struct MemoryArena
+    {
+        byte *base;
+        size_t size;                   /* rounded up to the page size that backs it */
+        size_t huge_page_bytes;        /* what this arena added to the statistics, taken back off on release */
+        size_t prefaulted_bytes;
+    };
+
+    void MemorySetArenaPolicy( const MemoryArenaPolicy &policy );
+    MemoryArenaPolicy MemoryGetArenaPolicy();
+    MemoryArenaStatistics MemoryGetArenaStatistics();
+    MemoryArena MemoryReserveArena( size_t capacity );
+    void MemoryReleaseArena( MemoryArena &arena );
+
+    typedef enum
+    {
+        MEMORY_SYSTEM_BACKEND_STACK, /* frees must come back in reverse order to be reclaimed */
+        MEMORY_SYSTEM_BACKEND_TLSF   /* general purpose heap */
+    } MemorySystemBackend;
+
+    /* MemorySystem puts a header on every allocation to keep per-tag counters and name leaks by tag.  On in
+       debug builds unless MEMORY_NO_TAG_TRACKING is defined, and off in release unless MEMORY_TAG_TRACKING is. */
+#if defined( _DEBUG ) && !defined( MEMORY_NO_TAG_TRACKING ) && !defined( MEMORY_TAG_TRACKING )
+#define MEMORY_TAG_TRACKING
+#endif
+
     class MemorySystem : public IMemoryAllocator
     {
     public:
-        MemorySystem( size_t capacity );
+        MemorySystem( size_t capacity, MemorySystemBackend backend = MEMORY_SYSTEM_BACKEND_STACK, const wchar_t *name = L"MemorySystem" );
         ~MemorySystem();
 
-        void * Allocate( size_t size, const wchar_t *user_name = nullptr );
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
         void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
+        bool GetHeapStatistics( MemoryHeapStatistics &statistics );
+        size_t ReportLeaks();
+#if defined( MEMORY_TAG_TRACKING )
+        inline const MemoryTagStatistics & GetTagStatistics( MemoryTag tag ) { assert( tag < MEMORY_TAG_CNT ); return m_tags[ tag ]; }
+        void DumpTagStatistics();
+#endif
 
     private:
-        byte *m_system_memory;
+#if defined( MEMORY_TAG_TRACKING )
+        /* sits in front of every allocation so Free knows what to take off the tag counters */
+        struct AllocationHeader
+        {
+            size_t size;
+            MemoryTag tag;
+        };
+
+        static const size_t ALLOCATION_HEADER_SIZE = ( sizeof( AllocationHeader ) + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+#else
+        static const size_t ALLOCATION_HEADER_SIZE = 0;
+#endif
+
+        std::wstring m_name;
+        size_t m_capacity;
+        MemoryArena m_system_memory;
+        MemorySystemBackend m_backend;
         MemoryAllocatorPtr m_allocator;
-        std::vector<std::pair<const wchar_t*, void *>> m_allocations;
+        size_t m_failed_cnt;
+        std::vector<void*> m_allocations;
         std::list<void*> m_frees;
+#if defined( MEMORY_TAG_TRACKING )
+        size_t m_live_bytes;
+        size_t m_peak_bytes;
+        size_t m_allocation_cnt;
+        std::array<MemoryTagStatistics, MEMORY_TAG_CNT> m_tags;
+#endif
+
+        size_t GetStrandedBytes();
+    };
+
+    /* Thread safe front end for another allocator.  Each thread keeps a small magazine of recently freed blocks
+       per tag and size class, so a block is only ever handed out again under the tag the central allocator
+       counted it against.  The central lock is only taken to refill or drain a magazine, or for blocks too big
+       to cache.  Blocks cached by a thread that has exited are returned when the allocator is destroyed.
+       GetStatistics reports the central allocator, so blocks parked in magazines count as live. */
+    class MemoryThreadCachedAllocator : public IMemoryAllocator
+    {
+    public:
+        MemoryThreadCachedAllocator( MemoryAllocatorPtr central );
+        ~MemoryThreadCachedAllocator();
+
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
+        void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
+        void FlushThreadCache();
+
+    private:
+        static const size_t SIZE_CLASS_MIN_LOG2 = 4;
+        static const size_t SIZE_CLASS_CNT = 8;                   /* 16 bytes through 2 KB */
+        static const size_t SIZE_CLASS_UNCACHED = SIZE_CLASS_CNT;
+        static const size_t MAGAZINE_SIZE = 32;
+        static const size_t MAGAZINE_TRANSFER_CNT = MAGAZINE_SIZE / 2;
+
+        struct BlockHeader
+        {
+            size_t size_class;
+            MemoryTag tag;
+        };
+
+        static const size_t BLOCK_HEADER_SIZE = ( sizeof( BlockHeader ) + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+
+        struct Magazine
+        {
+            size_t count;
+            std::array<byte*, MAGAZINE_SIZE> blocks;
+        };
+
+        struct ThreadCache
+        {
+            std::array<std::array<Magazine, SIZE_CLASS_CNT>, MEMORY_TAG_CNT> magazines;
+        };
+
+        MemoryAllocatorPtr m_central;
+        std::mutex m_central_lock;
+        std::vector<ThreadCache*> m_caches; /* one per thread that has used this allocator */
+        uint64_t m_id;
+        std::shared_ptr<std::atomic<bool>> m_alive; /* shared with each thread's entry, so threads can drop entries for destroyed allocators */
+
+        ThreadCache * GetThreadCache();
+        void DrainMagazine( Magazine &magazine, size_t count );
+        static size_t GetSizeClass( size_t size );
+        static inline size_t GetSizeClassBytes( size_t size_class ) { return static_cast<size_t>( 1 ) << ( size_class + SIZE_CLASS_MIN_LOG2 ); }
+    };
+
+    /* Pools of equal sized slots, one per object size given at construction, for objects that are created and
+       released constantly (e.g. one pool per network packet type).  Each request is served by the smallest
+       pool that fits it.  Slots are carved from chunks taken from the backing allocator and stay with the pool
+       until it is destroyed.  Requests bigger than every pool go straight to the backing allocator.  Not
+       thread safe. */
+    class MemoryFixedSizePools : public IMemoryAllocator
+    {
+    public:
+        MemoryFixedSizePools( MemoryAllocatorPtr backing, const std::vector<size_t> &object_sizes, size_t objects_per_chunk = 64 );
+        ~MemoryFixedSizePools();
+
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
+        void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();  /* fragmentation is the share of chunk memory idle in free slots */
+
+        inline size_t GetPoolCount() { return m_pools.size(); }
+        inline size_t GetLiveCount( size_t pool_index ) { return m_pools[ pool_index ].live_cnt; }
+
+    private:
+        static const size_t POOL_INDEX_UNPOOLED = static_cast<size_t>( -1 );
+
+        struct SlotHeader
+        {
+            size_t pool_index;
+            size_t size;        /* requested bytes */
+        };
+
+        static const size_t SLOT_HEADER_SIZE = ( sizeof( SlotHeader ) + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+
+        struct FreeSlot
+        {
+            FreeSlot *next;
+        };
+
+        struct Pool
+        {
+            size_t object_size;
+            size_t slot_size;
+            FreeSlot *free_list;
+            byte *head;     /* next never used slot in the newest chunk */
+            byte *tail;
+            size_t live_cnt;
+        };
+
+        MemoryAllocatorPtr m_backing;
+        std::vector<Pool> m_pools;    /* sorted by object size */
+        std::vector<void*> m_chunks;
+        size_t m_objects_per_chunk;
+        size_t m_chunk_bytes;
+        size_t m_live_bytes;
+        size_t m_peak_bytes;
+        size_t m_allocation_cnt;
+        size_t m_failed_cnt;
+    };
+
+    /* Base for objects shared through MemoryRefPtr.  The count is not atomic, so an object must only be
+       referenced from one thread at a time. */
+    class MemoryRefCounted
+    {
+        template <typename T> friend class MemoryRefPtr;
+    public:
+        virtual ~MemoryRefCounted() {};
+
+        /* the allocator the object was placed in, and is returned to when the last reference goes away */
+        void BindAllocator( IMemoryAllocator *allocator ) { m_allocator = allocator; }
+
+    protected:
+        MemoryRefCounted() : m_ref_cnt( 0 ), m_allocator( nullptr ) {};
+
+    private:
+        uint32_t m_ref_cnt;
+        IMemoryAllocator *m_allocator;
+    };
+
+    /* Intrusive reference to a MemoryRefCounted object.  Copying costs an increment, with no control block to
+       allocate.  The bound allocator must outlive every reference. */
+    template <typename T>
+    class MemoryRefPtr
+    {
+    public:
+        MemoryRefPtr() : m_object( nullptr ) {};
+        MemoryRefPtr( std::nullptr_t ) : m_object( nullptr ) {};
+        MemoryRefPtr( T *object ) : m_object( object ) { AddRef(); }
+        MemoryRefPtr( const MemoryRefPtr &other ) : m_object( other.m_object ) { AddRef(); }
+        MemoryRefPtr( MemoryRefPtr &&other ) : m_object( other.m_object ) { other.m_object = nullptr; }
+        ~MemoryRefPtr() { Release(); }
+
+        MemoryRefPtr & operator=( MemoryRefPtr other )
+        {
+            std::swap( m_object, other.m_object );
+            return *this;
+        }
+
+        inline T * operator->() const { return m_object; }
+        inline T & operator*() const { return *m_object; }
+        inline T * get() const { return m_object; }
+        inline explicit operator bool() const { return m_object != nullptr; }
+
+        void reset()
+        {
+            Release();
+            m_object = nullptr;
+        }
+
+    private:
+        T *m_object;
+
+        inline void AddRef()
+        {
+            if( m_object )
+            {
+                m_object->m_ref_cnt++;
+            }
+        }
+
+        void Release()
+        {
+            if( !m_object
+             || --m_object->m_ref_cnt )
+            {
+                return;
+            }
+
+            auto allocator = m_object->m_allocator;
+            MemoryRefCounted *object = m_object;
+            object->~MemoryRefCounted();
+            if( allocator )
+            {
+                allocator->Free( object );
+            }
+        }
     };
 
+    /* Linear scratch memory for data that only lives for one frame.  Allocate is a pointer bump, Free does
+       nothing, and Reset hands the whole arena back at once. */
+    class FrameArena : public IMemoryAllocator
+    {
+    public:
+        FrameArena( size_t capacity );
+        ~FrameArena();
+
+        void * Allocate( size_t size, MemoryTag tag = MEMORY_TAG_UNKNOWN );
+        void Free( void *allocation );
+        MemoryAllocatorStatistics GetStatistics();
+        void Reset();
+
+        inline size_t GetCurrentUsed() { return m_head - m_pool; }
+        inline size_t GetCapacity() { return m_pool_size; }
+        inline size_t GetHighWater() { return m_high_water; }
+
+    private:
+        static const size_t ALIGN_SIZE = alignof( std::max_align_t );
+
+        MemoryArena m_arena;
+        byte *m_pool;
+        byte *m_head;
+        size_t m_pool_size;
+        size_t m_high_water;
+        size_t m_allocation_cnt;    /* since the last Reset */
+        size_t m_failed_cnt;
+    }; typedef std::shared_ptr<FrameArena> FrameArenaPtr;
+
     template <typename T, size_t objects_per_chunk>
     class MemoryChunkAllocator
     {
-        typedef struct
+        static const size_t LIVE_WORD_CNT = ( objects_per_chunk + 63 ) / 64;
+
+        /* each chunk is one allocation from the parent: this header followed by the object slots */
+        struct Chunk
         {
-            MemoryAllocatorPtr allocator;
-            std::list<T*> objects;
-        } Chunk;
+            MemoryPoolAllocator pool;
+            Chunk *next_free;
+            bool in_free_list;
+            std::array<uint64_t, LIVE_WORD_CNT> live; /* one bit per slot */
+
+            Chunk( byte *objects ) :
+                pool( objects, CHUNK_OBJECTS_SIZE, sizeof( T ) ),
+                next_free( nullptr ),
+                in_free_list( false )
+            {
+                live.fill( 0 );
+            }
+
+            inline byte * Objects() { return reinterpret_cast<byte*>( this ) + CHUNK_HEADER_SIZE; }
+            inline size_t SlotIndex( void *address ) { return ( reinterpret_cast<byte*>( address ) - Objects() ) / SLOT_SIZE; }
+            inline T * Slot( size_t index ) { return reinterpret_cast<T*>( Objects() + index * SLOT_SIZE ); }
+        };
+
+        static const size_t SLOT_SIZE = MemoryPoolAllocator::GetSlotSize( sizeof( T ) ); /* has to match the pool's stride */
+        static const size_t CHUNK_HEADER_SIZE = ( sizeof( Chunk ) + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+        static const size_t CHUNK_OBJECTS_SIZE = objects_per_chunk * SLOT_SIZE;
 
     public:
-        MemoryChunkAllocator( MemoryAllocatorPtr allocator, const wchar_t *user_name = nullptr ) :
+        MemoryChunkAllocator( MemoryAllocatorPtr allocator, MemoryTag tag = MEMORY_TAG_UNKNOWN ) :
             m_allocator( allocator ),
-            m_user_name( user_name )
+            m_free_chunks( nullptr ),
+            m_tag( tag )
         {
             CreateNewChunk();
         }
 
-        void * Allocate()
+        ~MemoryChunkAllocator()
         {
-            Chunk *chunk = nullptr;
-            for( auto &search : m_chunks )
+            for( auto it = m_chunks.rbegin(); it != m_chunks.rend(); it++ )
             {
-                if( search.objects.size() < objects_per_chunk )
-                {
-                    chunk = &search;
-                    break;
-                }
+                ( *it )->~Chunk();
+                m_allocator->Free( *it );
             }
+        }
+
+        MemoryChunkAllocator( const MemoryChunkAllocator& ) = delete;
+        MemoryChunkAllocator & operator=( const MemoryChunkAllocator& ) = delete;
 
+        void * Allocate()
+        {
+            auto chunk = m_free_chunks;
             if( !chunk )
             {
                 chunk = CreateNewChunk();
+                if( !chunk )
+                {
+                    return nullptr;
+                }
             }
 
-            auto new_object = chunk->allocator->Allocate( sizeof( T ), m_user_name );
+            auto new_object = chunk->pool.Allocate( sizeof( T ), m_tag );
+            auto slot = chunk->SlotIndex( new_object );
+            chunk->live[ slot / 64 ] |= 1ull << ( slot % 64 );
+
+            /* only the head of the free list is ever allocated from, so it is the only chunk that can fill up */
+            if( chunk->pool.IsFull() )
+            {
+                m_free_chunks = chunk->next_free;
+                chunk->next_free = nullptr;
+                chunk->in_free_list = false;
+            }
 
             return new_object;
         }
 
         void Free( void *address )
         {
-            auto freed = false;
-            for( auto &chunk : m_chunks )
+            auto chunk = FindOwningChunk( address );
+            assert( chunk );
+
+            auto slot = chunk->SlotIndex( address );
+            assert( chunk->live[ slot / 64 ] & ( 1ull << ( slot % 64 ) ) );
+            chunk->live[ slot / 64 ] &= ~( 1ull << ( slot % 64 ) );
+            chunk->pool.Free( address );
+
+            if( !chunk->in_free_list )
             {
-                for( auto it = chunk.objects.begin(); it != chunk.objects.end(); it++ )
+                chunk->next_free = m_free_chunks;
+                chunk->in_free_list = true;
+                m_free_chunks = chunk;
+            }
+        }
+
+        class iterator
+        {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef T * pointer;
+            typedef T & reference;
+
+        private:
+            typename std::vector<Chunk*>::iterator m_current_chunk;
+            typename std::vector<Chunk*>::iterator m_end_chunk;
+            size_t m_current_word;
+            uint64_t m_remaining_bits;
+            T *m_current_object;         /* null once past the last chunk */
+
+            /* find the next live slot a 64 bit word at a time */
+            inline void SkipFreeSlots()
+            {
+                while( m_current_chunk != m_end_chunk )
                 {
-                    if( *it == address )
+                    while( !m_remaining_bits )
                     {
-                        chunk.allocator->Free( address );
-                        chunk.objects.erase( it );
-                        freed = true;
-                        break;
+                        if( ++m_current_word == LIVE_WORD_CNT )
+                        {
+                            break;
+                        }
+
+                        m_remaining_bits = ( *m_current_chunk )->live[ m_current_word ];
+                    }
+
+                    if( m_remaining_bits )
+                    {
+                        m_current_object = ( *m_current_chunk )->Slot( m_current_word * 64 + MemoryLowestSetBit( m_remaining_bits ) );
+                        m_remaining_bits &= m_remaining_bits - 1;
+                        return;
+                    }
+
+                    if( ++m_current_chunk != m_end_chunk )
+                    {
+                        m_current_word = 0;
+                        m_remaining_bits = ( *m_current_chunk )->live[ 0 ];
                     }
                 }
 
-                if( freed )
+                m_current_word = 0;
+                m_remaining_bits = 0;
+                m_current_object = nullptr;
+            }
+
+        public:
+            iterator( typename std::vector<Chunk*>::iterator begin, typename std::vector<Chunk*>::iterator end ) :
+                m_current_chunk( begin ),
+                m_end_chunk( end ),
+                m_current_word( 0 ),
+                m_remaining_bits( begin != end ? ( *begin )->live[ 0 ] : 0 ),
+                m_current_object( nullptr )
+            {
+                SkipFreeSlots();
+            }
+
+            inline iterator & operator++()
+            {
+                SkipFreeSlots();
+
+                return *this;
+            }
+
+            inline iterator & operator++( int )
+            {
+                return operator++();
+            }
+
+            inline bool operator==( const iterator &other )
+            {
+                return m_current_object == other.m_current_object;
+            }
+
+            inline bool operator!=( const iterator &other )
+            {
+                return !operator==( other );
+            }
+
+            inline T & operator*()
+            {
+                return *m_current_object;
+            }
+
+            inline T * operator->()
+            {
+                return m_current_object;
+            }
+        };
+
+        inline iterator begin()
+        {
+            return iterator( m_chunks.begin(), m_chunks.end() );
+        }
+
+        inline iterator end()
+        {
+            return iterator( m_chunks.end(), m_chunks.end() );
+        }
+
+    private:
+        MemoryAllocatorPtr m_allocator;
+        std::vector<Chunk*> m_chunks; /* sorted by address */
+        Chunk *m_free_chunks;         /* chunks with at least one free slot */
+        MemoryTag m_tag;
+
+        Chunk * CreateNewChunk()
+        {
+            auto memory = reinterpret_cast<byte*>( m_allocator->Allocate( CHUNK_HEADER_SIZE + CHUNK_OBJECTS_SIZE, m_tag ) );
+            if( !memory )
+            {
+                return nullptr;
+            }
+
+            auto new_chunk = new( memory ) Chunk( memory + CHUNK_HEADER_SIZE );
+            new_chunk->next_free = m_free_chunks;
+            new_chunk->in_free_list = true;
+            m_free_chunks = new_chunk;
+
+            m_chunks.insert( std::upper_bound( m_chunks.begin(), m_chunks.end(), new_chunk ), new_chunk );
+
+            return new_chunk;
+        }
+
+        Chunk * FindOwningChunk( void *address )
+        {
+            /* the owner is the last chunk that starts at or below the address */
+            auto found = std::upper_bound( m_chunks.begin(), m_chunks.end(), address, []( void *search, Chunk *chunk )
+            {
+                return search < static_cast<void*>( chunk );
+            } );
+
+            if( found == m_chunks.begin() )
+            {
+                return nullptr;
+            }
+
+            auto chunk = *( --found );
+            if( !chunk->pool.Owns( address ) )
+            {
+                return nullptr;
+            }
+
+            return chunk;
+        }
+    };
+
+    typedef uint32_t MemoryDenseHandle;
+    static const MemoryDenseHandle MEMORY_DENSE_HANDLE_INVALID = 0xffffffff;
+
+    /* Like MemoryChunkAllocator, but each chunk keeps its live objects packed at the front so iteration is a
+       linear sweep.  Freeing moves the chunk's last object into the hole, so objects are addressed through
+       stable handles instead of pointers.  T must be move constructible. */
+    template <typename T, size_t objects_per_chunk>
+    class MemoryDenseChunkAllocator
+    {
+        struct Chunk
+        {
+            size_t object_cnt;
+            Chunk *next_free;
+            bool in_free_list;
+            std::array<MemoryDenseHandle, objects_per_chunk> handles; /* slot -> handle */
+
+            inline T * Objects() { return reinterpret_cast<T*>( reinterpret_cast<byte*>( this ) + CHUNK_HEADER_SIZE ); }
+        };
+
+        struct HandleEntry
+        {
+            Chunk *chunk;
+            uint32_t slot;
+            MemoryDenseHandle next_free;
+        };
+
+        static const size_t CHUNK_HEADER_SIZE = ( sizeof( Chunk ) + alignof( std::max_align_t ) - 1 ) & ~( alignof( std::max_align_t ) - 1 );
+        static const size_t CHUNK_OBJECTS_SIZE = objects_per_chunk * sizeof( T );
+
+    public:
+        MemoryDenseChunkAllocator( MemoryAllocatorPtr allocator, MemoryTag tag = MEMORY_TAG_UNKNOWN ) :
+            m_allocator( allocator ),
+            m_free_chunks( nullptr ),
+            m_free_handles( MEMORY_DENSE_HANDLE_INVALID ),
+            m_tag( tag )
+        {
+        }
+
+        ~MemoryDenseChunkAllocator()
+        {
+            for( auto it = m_chunks.rbegin(); it != m_chunks.rend(); it++ )
+            {
+                m_allocator->Free( *it );
+            }
+        }
+
+        MemoryDenseChunkAllocator( const MemoryDenseChunkAllocator& ) = delete;
+        MemoryDenseChunkAllocator & operator=( const MemoryDenseChunkAllocator& ) = delete;
+
+        /* reserve a slot; the caller constructs the object in place at Get( handle ) */
+        MemoryDenseHandle Allocate()
+        {
+            auto chunk = m_free_chunks;
+            if( !chunk )
+            {
+                chunk = CreateNewChunk();
+                if( !chunk )
                 {
-                    break;
+                    return MEMORY_DENSE_HANDLE_INVALID;
                 }
             }
 
-            assert( freed );
+            auto handle = m_free_handles;
+            if( handle == MEMORY_DENSE_HANDLE_INVALID )
+            {
+                handle = static_cast<MemoryDenseHandle>( m_handles.size() );
+                m_handles.emplace_back();
+            }
+            else
+            {
+                m_free_handles = m_handles[ handle ].next_free;
+            }
+
+            auto slot = chunk->object_cnt++;
+            chunk->handles[ slot ] = handle;
+            m_handles[ handle ].chunk = chunk;
+            m_handles[ handle ].slot = static_cast<uint32_t>( slot );
+            m_handles[ handle ].next_free = MEMORY_DENSE_HANDLE_INVALID;
+
+            if( chunk->object_cnt == objects_per_chunk )
+            {
+                m_free_chunks = chunk->next_free;
+                chunk->next_free = nullptr;
+                chunk->in_free_list = false;
+            }
+
+            return handle;
         }
 
-        class iterator : public std::iterator<std::forward_iterator_tag, T>
+        /* release a slot whose object the caller has already destroyed */
+        void Free( MemoryDenseHandle handle )
         {
-            typename std::list<Chunk>::iterator m_current_chunk;
-            typename std::list<Chunk>::iterator m_end_chunk;
+            assert( handle < m_handles.size() );
+            auto &entry = m_handles[ handle ];
+            auto chunk = entry.chunk;
+            assert( chunk );
+
+            /* swap-remove: relocate the chunk's last object into the hole and repoint its handle */
+            auto last = chunk->object_cnt - 1;
+            if( entry.slot != last )
+            {
+                auto objects = chunk->Objects();
+                new( &objects[ entry.slot ] ) T( std::move( objects[ last ] ) );
+                objects[ last ].~T();
 
-            typename std::list<T*>::iterator m_current_object;
+                auto moved_handle = chunk->handles[ last ];
+                chunk->handles[ entry.slot ] = moved_handle;
+                m_handles[ moved_handle ].slot = entry.slot;
+            }
 
+            chunk->object_cnt--;
+
+            entry.chunk = nullptr;
+            entry.next_free = m_free_handles;
+            m_free_handles = handle;
+
+            if( !chunk->in_free_list )
+            {
+                chunk->next_free = m_free_chunks;
+                chunk->in_free_list = true;
+                m_free_chunks = chunk;
+            }
+        }
+
+        inline T * Get( MemoryDenseHandle handle )
+        {
+            assert( handle < m_handles.size() && m_handles[ handle ].chunk );
+            auto &entry = m_handles[ handle ];
+            return &entry.chunk->Objects()[ entry.slot ];
+        }
+
+        class iterator
+        {
         public:
-            iterator( typename std::list<Chunk>::iterator begin, typename std::list<Chunk>::iterator end ) :
-                m_current_chunk( begin ),
-                m_end_chunk( end )
+            typedef std::forward_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef T * pointer;
+            typedef T & reference;
+
+        private:
+            typename std::vector<Chunk*>::iterator m_current_chunk;
+            typename std::vector<Chunk*>::iterator m_end_chunk;
+            T *m_current_object;
+            T *m_end_object;
+
+            inline void EnterChunk()
             {
-                if( begin == end )
+                while( m_current_chunk != m_end_chunk )
                 {
-                    m_current_object = std::prev( m_end_chunk )->objects.end();
-                    return;
+                    m_current_object = ( *m_current_chunk )->Objects();
+                    m_end_object = m_current_object + ( *m_current_chunk )->object_cnt;
+                    if( m_current_object != m_end_object )
+                    {
+                        return;
+                    }
+
+                    m_current_chunk++;
                 }
 
-                m_current_object = m_current_chunk->objects.begin();
+                m_current_object = nullptr;
+                m_end_object = nullptr;
             }
 
-            inline iterator & operator++( int )
+        public:
+            iterator( typename std::vector<Chunk*>::iterator begin, typename std::vector<Chunk*>::iterator end ) :
+                m_current_chunk( begin ),
+                m_end_chunk( end )
+            {
+                EnterChunk();
+            }
+
+            inline iterator & operator++()
             {
-                if( m_current_chunk != m_end_chunk )
+                if( ++m_current_object == m_end_object )
                 {
-                    m_current_object++;
-                    if( m_current_object == m_current_chunk->objects.end() )
-                    {
-                        m_current_chunk++;
-                        if( m_current_chunk != m_end_chunk )
-                        {
-                            m_current_object = m_current_chunk->objects.begin();
-                        }
-                    }
+                    m_current_chunk++;
+                    EnterChunk();
                 }
 
                 return *this;
             }
 
+            inline iterator & operator++( int )
+            {
+                return operator++();
+            }
+
             inline bool operator==( const iterator &other )
             {
-                return m_current_chunk == other.m_current_chunk && m_current_object == other.m_current_object;
+                return m_current_object == other.m_current_object;
             }
 
             inline bool operator!=( const iterator &other )
@@ -182,7 +966,7 @@ namespace Engine
 
             inline T * operator->()
             {
-                return *m_current_object;
+                return m_current_object;
             }
         };
 
@@ -196,20 +980,42 @@ namespace Engine
             return iterator( m_chunks.end(), m_chunks.end() );
         }
 
+        /* sweep every live object, one contiguous run per chunk */
+        template <typename FUNC>
+        void ForEach( FUNC func )
+        {
+            for( auto chunk : m_chunks )
+            {
+                auto objects = chunk->Objects();
+                for( size_t i = 0; i < chunk->object_cnt; i++ )
+                {
+                    func( objects[ i ] );
+                }
+            }
+        }
+
     private:
         MemoryAllocatorPtr m_allocator;
-        std::list<Chunk> m_chunks;
-        const wchar_t *m_user_name;
+        std::vector<Chunk*> m_chunks;
+        std::vector<HandleEntry> m_handles;
+        Chunk *m_free_chunks;
+        MemoryDenseHandle m_free_handles;
+        MemoryTag m_tag;
 
         Chunk * CreateNewChunk()
         {
-            size_t object_size = sizeof( T );
-            size_t chunk_size = objects_per_chunk * object_size;
-            auto pool = reinterpret_cast<byte*>(m_allocator->Allocate( chunk_size, m_user_name ));
+            auto memory = reinterpret_cast<byte*>( m_allocator->Allocate( CHUNK_HEADER_SIZE + CHUNK_OBJECTS_SIZE, m_tag ) );
+            if( !memory )
+            {
+                return nullptr;
+            }
 
-            m_chunks.emplace_back();
-            auto *new_chunk = &m_chunks.back();
-            new_chunk->allocator = MemoryAllocatorPtr( new MemoryPoolAllocator( pool, chunk_size, object_size ) );
+            auto new_chunk = reinterpret_cast<Chunk*>( memory );
+            new_chunk->object_cnt = 0;
+            new_chunk->next_free = m_free_chunks;
+            new_chunk->in_free_list = true;
+            m_free_chunks = new_chunk;
+            m_chunks.push_back( new_chunk );
 
             return new_chunk;
         }
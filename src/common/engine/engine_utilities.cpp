@@ -79,7 +79,8 @@ void Engine::Log( const LogLevel level, std::wstring format, ... )
 
     format.append( L"\n" );
     
-    static wchar_t buffer[4096];
+    /* the server logs from its packet reading workers too, so each thread formats into its own buffer */
+    thread_local wchar_t buffer[4096];
     va_list args;
     va_start( args, format );
 
@@ -88,7 +89,7 @@ void Engine::Log( const LogLevel level, std::wstring format, ... )
     OutputDebugString( buffer );
 
 #if defined SERVER
-    wprintf( buffer );
+    wprintf( L"%s", buffer );
 #endif
 }
 
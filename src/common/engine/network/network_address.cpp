@@ -52,6 +52,13 @@ boolean Engine::NetworkAddress::Matches( const NetworkAddress &other )
          && mine.GetAddressIn()->sin_family           == theirs.GetAddressIn()->sin_family );
 }
 
+uint64_t Engine::NetworkAddress::Pack()
+{
+    return static_cast<uint64_t>( GetAddressIn()->sin_family ) << 48
+         | static_cast<uint64_t>( GetAddressIn()->sin_port ) << 32
+         | GetAddressIn()->sin_addr.S_un.S_addr;
+}
+
 Concurrency::task<Engine::NetworkAddressPtr> Engine::NetworkAddressFactory::CreateAddressFromStringAsync( const std::wstring address_string )
 {
     using namespace Concurrency;
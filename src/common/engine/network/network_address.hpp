@@ -15,6 +15,7 @@ namespace Engine
         std::wstring Print();
         int Port();
         boolean Matches( const NetworkAddress &other );
+        uint64_t Pack();    /* family, port and address in one word, equal exactly when Matches */
 
     private:
         sockaddr m_address;
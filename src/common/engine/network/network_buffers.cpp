@@ -2,17 +2,63 @@
 
 #include "network_buffers.hpp"
 
-Engine::BitStreamBase::BitStreamBase( bool is_owned ) :
+namespace
+{
+    /* word loads and stores for the last few bytes of a buffer, where a whole word would run off the end */
+    inline uint64_t LoadPartialWord( const byte *source, size_t byte_cnt )
+    {
+        uint64_t word = 0;
+        for( size_t i = 0; i < byte_cnt; i++ )
+        {
+            word |= static_cast<uint64_t>( source[ i ] ) << ( 8 * i );
+        }
+
+        return word;
+    }
+
+    inline void StorePartialWord( byte *destination, uint64_t word, size_t byte_cnt )
+    {
+        for( size_t i = 0; i < byte_cnt; i++ )
+        {
+            destination[ i ] = static_cast<byte>( word >> ( 8 * i ) );
+        }
+    }
+
+    /* nearly every quaternion is written at the default width, so its quantization is only built once */
+    static const Engine::FloatQuantization QUAT_COMPONENT_QUANTIZATION = Engine::FloatQuantization::WithBitCount( -BITSTREAM_QUAT_COMPONENT_MAX, BITSTREAM_QUAT_COMPONENT_MAX, BITSTREAM_QUAT_COMPONENT_BITS );
+
+    inline Engine::FloatQuantization QuatComponentQuantization( uint32_t component_bit_cnt )
+    {
+        if( component_bit_cnt == BITSTREAM_QUAT_COMPONENT_BITS )
+        {
+            return QUAT_COMPONENT_QUANTIZATION;
+        }
+
+        return Engine::FloatQuantization::WithBitCount( -BITSTREAM_QUAT_COMPONENT_MAX, BITSTREAM_QUAT_COMPONENT_MAX, component_bit_cnt );
+    }
+}
+
+Engine::BitStreamBase::BitStreamBase( bool is_owned, MemoryAllocatorPtr allocator ) :
     m_buffer( nullptr ),
     m_bit_head( 0 ),
     m_bit_capacity( 0 ),
-    m_owned( is_owned )
+    m_owned( is_owned ),
+    m_allocator( allocator )
 {
 }
 
 Engine::BitStreamBase::~BitStreamBase()
 {
-    if( m_owned )
+    if( !m_owned )
+    {
+        return;
+    }
+
+    if( m_allocator )
+    {
+        m_allocator->Free( m_buffer );
+    }
+    else
     {
         std::free( m_buffer );
     }
@@ -21,7 +67,19 @@ Engine::BitStreamBase::~BitStreamBase()
 void Engine::BitStreamBase::ReallocateBuffer( const size_t size )
 {
     assert( m_owned );
-    if( !m_buffer )
+    if( m_allocator )
+    {
+        auto buffer = static_cast<byte*>( m_allocator->Allocate( size, MEMORY_TAG_NETWORK_BUFFERS ) );
+        assert( buffer );
+        if( m_buffer )
+        {
+            std::memcpy( buffer, m_buffer, std::min( size, GetCapacityBytes() ) );
+            m_allocator->Free( m_buffer );
+        }
+
+        BindBuffer( buffer, size );
+    }
+    else if( !m_buffer )
     {
         BindBuffer( static_cast<byte*>(std::malloc( size )), size );
     }
@@ -37,31 +95,9 @@ void Engine::BitStreamBase::BindBuffer( byte* buffer, const size_t size )
     m_bit_capacity = 8 * size;
 }
 
-int Engine::BitStreamBase::BitsRequired( uint64_t value )
-{
-    if( value == 0 )
-    {
-        return 1;
-    }
-
-    int required_bits = 0;
-    while( value )
-    {
-        value >>= 1;
-        required_bits++;
-    }
-
-    return required_bits;
-}
-
-int Engine::BitStreamBase::BytesRequired( uint64_t value )
-{
-    int required_bits = BitsRequired( value );
-    return (required_bits + 7) / 8;
-}
-
-Engine::InputBitStream::InputBitStream( byte *input, const size_t size, bool owned ) :
-    Engine::BitStreamBase( owned )
+Engine::InputBitStream::InputBitStream( byte *input, const size_t size, bool owned, MemoryAllocatorPtr allocator ) :
+    Engine::BitStreamBase( owned, allocator ),
+    m_error( false )
 {
     if( !owned )
     {
@@ -73,22 +109,29 @@ Engine::InputBitStream::InputBitStream( byte *input, const size_t size, bool own
     std::memcpy( m_buffer, input, size );
 }
 
-void Engine::InputBitStream::WriteBits( byte &out, size_t bit_cnt )
+uint64_t Engine::InputBitStream::ReadWordSlow( size_t bit_cnt )
 {
-    size_t byte_offset = m_bit_head / 8;
-    size_t bit_offset = m_bit_head % 8;
-
-    out = m_buffer[byte_offset] >> bit_offset;
+    assert( bit_cnt <= 64 );
+    if( bit_cnt > BITSTREAM_WORD_MAX_BITS )
+    {
+        auto low = ReadWord( 32 );
+        return low | ( ReadWord( bit_cnt - 32 ) << 32 );
+    }
 
-    auto free_bits_this_byte = 8 - bit_offset;
-    if( free_bits_this_byte < bit_cnt )
+    /* near the end of the buffer, load only the bytes that are left */
+    if( m_bit_head + bit_cnt > m_bit_capacity )
     {
-        /* go to the next byte */
-        out |= m_buffer[byte_offset + 1] << free_bits_this_byte;
+        SetError();
+        return 0;
     }
 
-    out &= ~(0xff << bit_cnt);
+    size_t byte_offset = m_bit_head / 8;
+    size_t bit_offset = m_bit_head % 8;
+    size_t capacity_bytes = GetCapacityBytes();
     m_bit_head += bit_cnt;
+
+    auto word = LoadPartialWord( m_buffer + byte_offset, std::min<size_t>( capacity_bytes - byte_offset, BITSTREAM_WORD_BYTES ) );
+    return ( word >> bit_offset ) & LowBitsMask( bit_cnt );
 }
 
 void Engine::InputBitStream::Write( NetworkKey & out )
@@ -112,27 +155,96 @@ byte * Engine::InputBitStream::GetBufferAtCurrent()
     return m_buffer + byte_offset;
 }
 
+void Engine::InputBitStream::WriteVarint( uint64_t &out )
+{
+    out = 0;
+    for( uint32_t shift = 0; shift < 64; shift += BITSTREAM_VARINT_GROUP_BITS )
+    {
+        auto group = ReadWord( 8 );
+        out |= ( group & 0x7f ) << shift;
+        if( !( group & 0x80 ) )
+        {
+            return;
+        }
+    }
+
+    /* more groups than a 64 bit value can need */
+    SetError();
+    out = 0;
+}
+
+void Engine::InputBitStream::WriteGamma( uint32_t &out )
+{
+    uint32_t zero_cnt = 0;
+    while( !ReadWord( 1 ) )
+    {
+        if( ++zero_cnt > 32
+         || m_error )
+        {
+            SetError();
+            out = 0;
+            return;
+        }
+    }
+
+    out = static_cast<uint32_t>( ( ( static_cast<uint64_t>( 1 ) << zero_cnt ) | ReadWord( zero_cnt ) ) - 1 );
+}
+
+void Engine::InputBitStream::Write( Quat &out, uint32_t component_bit_cnt )
+{
+    auto quantization = QuatComponentQuantization( component_bit_cnt );
+    auto largest = static_cast<uint32_t>( ReadWord( BITSTREAM_QUAT_INDEX_BITS ) );
+
+    /* the dropped component was made positive on write, so it is whatever is left of the unit length */
+    float components[ 4 ];
+    float sum = 0.0f;
+    for( uint32_t i = 0; i < 4; i++ )
+    {
+        if( i == largest )
+        {
+            continue;
+        }
+
+        Write( components[ i ], quantization );
+        sum += components[ i ] * components[ i ];
+    }
+
+    components[ largest ] = std::sqrt( std::max( 0.0f, 1.0f - sum ) );
+    out = Quat( components[ 0 ], components[ 1 ], components[ 2 ], components[ 3 ] );
+}
+
 void Engine::InputBitStream::WriteBits( void *out, size_t bit_cnt )
 {
     auto destination = reinterpret_cast<byte*>(out);
+    if( !bit_cnt )
+    {
+        return;
+    }
 
-    /* read the whole bytes */
-    while( bit_cnt > 8 )
+    /* byte aligned runs are a straight copy */
+    if( m_bit_head % 8 == 0
+     && bit_cnt % 8 == 0
+     && m_bit_head + bit_cnt <= m_bit_capacity )
     {
-        WriteBits( *destination, 8 );
-        ++destination;
-        bit_cnt -= 8;
+        std::memcpy( destination, m_buffer + m_bit_head / 8, bit_cnt / 8 );
+        m_bit_head += bit_cnt;
+        return;
     }
 
-    /* read any left over bits */
-    if( bit_cnt > 0 )
+    /* otherwise move seven bytes per word */
+    while( bit_cnt > 0 )
     {
-        WriteBits( *destination, bit_cnt );
+        auto chunk_bits = std::min<size_t>( bit_cnt, BITSTREAM_WORD_MAX_BITS );
+        auto chunk_bytes = ( chunk_bits + 7 ) / 8;
+        StorePartialWord( destination, ReadWord( chunk_bits ), chunk_bytes );
+        destination += chunk_bytes;
+        bit_cnt -= chunk_bits;
     }
 }
 
-Engine::OutputBitStream::OutputBitStream( byte *input, const size_t size, bool owned ) :
-    BitStreamBase( owned )
+Engine::OutputBitStream::OutputBitStream( byte *input, const size_t size, bool owned, MemoryAllocatorPtr allocator ) :
+    BitStreamBase( owned, allocator ),
+    m_scratch( 0 )
 {
     if( !owned )
     {
@@ -148,29 +260,37 @@ Engine::OutputBitStream::OutputBitStream( byte *input, const size_t size, bool o
     }
 }
 
-void Engine::OutputBitStream::WriteBits( byte &out, size_t bit_cnt )
+void Engine::OutputBitStream::Reserve( size_t byte_cnt )
 {
-    auto next_bit_head = m_bit_head + bit_cnt;
-
-    if( next_bit_head > m_bit_capacity )
+    if( byte_cnt <= GetCapacityBytes() )
     {
-        ReallocateBuffer( std::max( m_bit_capacity * 2, next_bit_head ) );
+        return;
     }
 
-    size_t byte_offset = m_bit_head / 8;
-    size_t bit_offset = m_bit_head % 8;
-
-    auto mask = ~(0xff << bit_offset);
-    m_buffer[byte_offset] = (m_buffer[byte_offset] & mask) | (out << bit_offset);
+    ReallocateBuffer( std::max( 2 * GetCapacityBytes(), byte_cnt ) );
+}
 
-    auto free_bits_this_byte = 8 - bit_offset;
-    if( free_bits_this_byte < bit_cnt )
+void Engine::OutputBitStream::Flush()
+{
+    size_t scratch_bits = m_bit_head % 64;
+    if( !scratch_bits )
     {
-        /* go to the next byte */
-        m_buffer[byte_offset + 1] = out >> free_bits_this_byte;
+        return;
     }
 
-    m_bit_head = next_bit_head;
+    size_t byte_offset = ( m_bit_head - scratch_bits ) / 8;
+    size_t byte_cnt = ( scratch_bits + 7 ) / 8;
+    Reserve( byte_offset + byte_cnt );
+    StorePartialWord( m_buffer + byte_offset, m_scratch, byte_cnt );
+}
+
+void Engine::OutputBitStream::Resync()
+{
+    /* the scratch word still holds what was written before the change, and would put it back on the next Flush.
+       the change covered whole bytes, so the head moves up to the end of the last one */
+    m_bit_head = 8 * GetCurrentByteCount();
+    size_t scratch_bits = m_bit_head % 64;
+    m_scratch = LoadPartialWord( m_buffer + ( m_bit_head - scratch_bits ) / 8, scratch_bits / 8 );
 }
 
 void Engine::OutputBitStream::Write( NetworkKey &out )
@@ -189,6 +309,51 @@ void Engine::OutputBitStream::Write( NetworkAuthentication &out )
     }
 }
 
+void Engine::OutputBitStream::WriteVarint( uint64_t out )
+{
+    do
+    {
+        auto group = out & 0x7f;
+        out >>= BITSTREAM_VARINT_GROUP_BITS;
+        WriteWord( out ? group | 0x80 : group, 8 );
+    } while( out );
+}
+
+void Engine::OutputBitStream::WriteGamma( uint32_t out )
+{
+    /* one less zero than the coded value has bits, then the coded value starting from its leading one */
+    auto coded = static_cast<uint64_t>( out ) + 1;
+    auto bit_cnt = BitsRequired( coded );
+    WriteWord( static_cast<uint64_t>( 1 ) << ( bit_cnt - 1 ), bit_cnt );
+    WriteWord( coded, bit_cnt - 1 );
+}
+
+void Engine::OutputBitStream::Write( Quat &out, uint32_t component_bit_cnt )
+{
+    auto quantization = QuatComponentQuantization( component_bit_cnt );
+    float components[ 4 ] = { out.x, out.y, out.z, out.w };
+
+    uint32_t largest = 0;
+    for( uint32_t i = 1; i < 4; i++ )
+    {
+        if( std::fabs( components[ i ] ) > std::fabs( components[ largest ] ) )
+        {
+            largest = i;
+        }
+    }
+
+    /* q and -q are the same rotation, so flip the sign to keep the dropped component positive */
+    float sign = components[ largest ] < 0.0f ? -1.0f : 1.0f;
+    WriteWord( largest, BITSTREAM_QUAT_INDEX_BITS );
+    for( uint32_t i = 0; i < 4; i++ )
+    {
+        if( i != largest )
+        {
+            Write( sign * components[ i ], quantization );
+        }
+    }
+}
+
 void Engine::OutputBitStream::Write( sockaddr &out )
 {
     Write( out.sa_family );
@@ -198,6 +363,7 @@ void Engine::OutputBitStream::Write( sockaddr &out )
 size_t Engine::OutputBitStream::Collapse()
 {
     assert( m_owned );
+    Flush();
     size_t size = GetSize();
     ReallocateBuffer( size );
     return(size);
@@ -206,18 +372,32 @@ size_t Engine::OutputBitStream::Collapse()
 void Engine::OutputBitStream::WriteBits( void *out, size_t bit_cnt )
 {
     auto source = reinterpret_cast<byte*>(out);
+    if( !bit_cnt )
+    {
+        return;
+    }
 
-    /* write the whole bytes */
-    while( bit_cnt > 8 )
+    /* byte aligned runs are copied straight in behind whatever is in the scratch word */
+    if( m_bit_head % 8 == 0
+     && bit_cnt % 8 == 0 )
     {
-        WriteBits( *source, 8 );
-        ++source;
-        bit_cnt -= 8;
+        Flush();
+        Reserve( ( m_bit_head + bit_cnt ) / 8 );
+        std::memcpy( m_buffer + m_bit_head / 8, source, bit_cnt / 8 );
+        m_bit_head += bit_cnt;
+
+        size_t scratch_bits = m_bit_head % 64;
+        m_scratch = LoadPartialWord( m_buffer + ( m_bit_head - scratch_bits ) / 8, scratch_bits / 8 );
+        return;
     }
 
-    /* write any left over bits */
-    if( bit_cnt > 0 )
+    /* otherwise move a word at a time */
+    while( bit_cnt > 0 )
     {
-        WriteBits( *source, bit_cnt );
+        auto chunk_bits = std::min<size_t>( bit_cnt, 64 );
+        auto chunk_bytes = ( chunk_bits + 7 ) / 8;
+        WriteWord( LoadPartialWord( source, chunk_bytes ), chunk_bits );
+        source += chunk_bytes;
+        bit_cnt -= chunk_bits;
     }
-}
\ No newline at end of file
+}
@@ -3,47 +3,165 @@
 #include "network_platform.hpp"
 #include "network_types.hpp"
 
+#include "common/engine/engine_math.hpp"
+#include "common/engine/engine_memory.hpp"
+
+/* Streams are packed least significant bit first, so a little endian word load or store lines up with the bit
+   order on the wire.  Up to 56 bits at any bit offset fit in one word read. */
+#define BITSTREAM_WORD_BYTES          ( sizeof( uint64_t ) )
+#define BITSTREAM_WORD_MAX_BITS       ( 56 )
+
+/* smallest three quaternions send the index of the dropped component and the other three, which all lie
+   within +/- 1 / sqrt( 2 ) */
+#define BITSTREAM_QUAT_INDEX_BITS     ( 2 )
+#define BITSTREAM_QUAT_COMPONENT_BITS ( 10 )
+#define BITSTREAM_QUAT_COMPONENT_MAX  ( 0.707107f )
+
+/* Variable length integers for values that are usually small.  A varint spends a byte on every seven bits of
+   the value, the high bit of each byte marking that another follows.  An Elias gamma code spends 2n - 1 bits on a
+   value that needs n bits after adding one, so it suits counters and offsets that are nearly always tiny:
+   0 costs one bit, 1-2 three bits, 3-6 five. */
+#define BITSTREAM_VARINT_GROUP_BITS   ( 7 )
+
+/* WriteInt<MIN, MAX> sends an integer or enum known to lie in [MIN, MAX] as its offset from MIN, in exactly the
+   bits the range needs.  The width is a compile time constant, e.g. WriteInt<0, MESSAGE_TYPE_CNT - 1>( type ). */
+
+/* Streams are plain value types with no virtual calls, so one over a caller's buffer can live on the stack:
+
+       NetworkNonce nonce;
+       OutputBitStream out( nonce.data(), nonce.size() );
+
+   costs nothing beyond the stream itself.  A stream constructed over a caller's buffer never grows or frees it;
+   one constructed from an allocator owns and grows its own buffer.  BitStreamFactory still hands out shared
+   streams for callers that pass them around. */
 namespace Engine
 {
     class BitStreamBase
     {
     public:
-        BitStreamBase( bool is_owned );
-        ~BitStreamBase();
+        BitStreamBase( const BitStreamBase& ) = delete;
+        BitStreamBase & operator=( const BitStreamBase& ) = delete;
 
         byte * GetBuffer() { return m_buffer; }
-        static int BitsRequired( uint64_t value );
-        static int BytesRequired( uint64_t value );
-        virtual size_t GetSize() = 0;
+        static constexpr int BitsRequired( uint64_t value )
+        {
+            int required_bits = 1;
+            while( value >>= 1 )
+            {
+                required_bits++;
+            }
+
+            return required_bits;
+        }
+
+        static constexpr int BytesRequired( uint64_t value ) { return ( BitsRequired( value ) + 7 ) / 8; }
+        static constexpr int RangeBitsRequired( int64_t min, int64_t max ) { return BitsRequired( static_cast<uint64_t>( max ) - static_cast<uint64_t>( min ) ); }
+        static constexpr int VarintBitsRequired( uint64_t value ) { return 8 * ( ( BitsRequired( value ) + BITSTREAM_VARINT_GROUP_BITS - 1 ) / BITSTREAM_VARINT_GROUP_BITS ); }
+        static constexpr int GammaBitsRequired( uint32_t value ) { return 2 * BitsRequired( static_cast<uint64_t>( value ) + 1 ) - 1; }
         void Reset() { m_bit_head = 0; }
 
     protected:
+        BitStreamBase( bool is_owned, MemoryAllocatorPtr allocator = nullptr );
+        ~BitStreamBase();
+
         byte     *m_buffer;
         size_t    m_bit_head;
         size_t    m_bit_capacity;
         bool      m_owned;
+        MemoryAllocatorPtr m_allocator; /* where owned buffers come from, or the system heap when null */
 
+        size_t GetCapacityBytes() { return m_bit_capacity / 8; }
         void ReallocateBuffer( const size_t size );
         void BindBuffer( byte* buffer, const size_t size );
+
+        static inline uint64_t LowBitsMask( size_t bit_cnt ) { return bit_cnt >= 64 ? ~static_cast<uint64_t>( 0 ) : ( static_cast<uint64_t>( 1 ) << bit_cnt ) - 1; }
+        static inline uint64_t LoadWord( const byte *source ) { uint64_t word; std::memcpy( &word, source, BITSTREAM_WORD_BYTES ); return ByteSwap( word ); }
+        static inline void StoreWord( byte *destination, uint64_t word ) { word = ByteSwap( word ); std::memcpy( destination, &word, BITSTREAM_WORD_BYTES ); }
+    };
+
+    /* A float bounded to [min, max] and sent as a whole number of resolution steps, so the bit count follows
+       from the range.  Build one per field, not per write. */
+    struct FloatQuantization
+    {
+        FloatQuantization( float _min, float _max, float _resolution ) :
+            min( _min ),
+            max( _max ),
+            resolution( _resolution ),
+            inverse_resolution( 1.0f / _resolution ),
+            step_cnt( static_cast<uint32_t>( std::ceil( ( _max - _min ) / _resolution ) ) ),
+            bit_cnt( BitStreamBase::BitsRequired( step_cnt ) )
+        {
+            assert( _max > _min );
+            assert( bit_cnt <= 32 );
+        }
+
+        /* the full range split evenly over an exact bit count */
+        static FloatQuantization WithBitCount( float min, float max, uint32_t bit_cnt )
+        {
+            assert( bit_cnt > 0 && bit_cnt <= 24 );
+            auto step_cnt = ( static_cast<uint32_t>( 1 ) << bit_cnt ) - 1;
+            FloatQuantization quantization( min, max, ( max - min ) / static_cast<float>( step_cnt ) );
+            quantization.step_cnt = step_cnt;
+            quantization.bit_cnt = bit_cnt;
+            return quantization;
+        }
+
+        inline uint32_t Quantize( float value ) const
+        {
+            /* written so NaN lands on min */
+            if( !( value > min ) ) return 0;
+            if( !( value < max ) ) return step_cnt;
+            return std::min( step_cnt, static_cast<uint32_t>( ( value - min ) * inverse_resolution + 0.5f ) );
+        }
+
+        inline float Dequantize( uint32_t value ) const { return std::min( max, min + static_cast<float>( value ) * resolution ); }
+
+        float    min;
+        float    max;
+        float    resolution;
+        float    inverse_resolution;
+        uint32_t step_cnt;
+        uint32_t bit_cnt;
     };
 
+    /* Reading past the end of the buffer puts the stream in a sticky error state: the read and every read after
+       it return zero, and the head parks at the end so decode loops run out.  The capacity check is only made
+       when a read crosses into the last word of the buffer, so a decoder can read everything and test
+       HasError() once at the end. */
     class InputBitStream : public BitStreamBase
     {
         friend class BitStreamFactory;
     public:
+        InputBitStream( byte *input, const size_t size ) : InputBitStream( input, size, false, nullptr ) {};
         ~InputBitStream() {};
 
+        bool HasError() { return m_error; }
+        void Reset() { m_bit_head = 0; m_error = false; }
         size_t GetRemainingBitCount() { return m_bit_capacity - m_bit_head; }
         size_t GetRemainingByteCount() { return (GetRemainingBitCount() + 7) / 8; }
         byte * GetBufferAtCurrent();
         size_t GetSize() { return (7 + m_bit_capacity) / 8; }
         size_t SaveCurrentLocation() { return m_bit_head; }
-        void SeekToLocation( size_t location ) { m_bit_head = location; }
+        void SeekToLocation( size_t location ) { if( location > m_bit_capacity ) SetError(); else m_bit_head = location; }
 
-        void Advance( uint32_t bit_cnt ) { m_bit_head += bit_cnt; }
+        void Advance( uint32_t bit_cnt ) { SeekToLocation( m_bit_head + bit_cnt ); }
+
+        inline uint64_t ReadWord( size_t bit_cnt )
+        {
+            size_t byte_offset = m_bit_head / 8;
+            if( bit_cnt > BITSTREAM_WORD_MAX_BITS
+             || byte_offset + BITSTREAM_WORD_BYTES > GetCapacityBytes() )
+            {
+                return ReadWordSlow( bit_cnt );
+            }
+
+            auto word = LoadWord( m_buffer + byte_offset ) >> ( m_bit_head % 8 );
+            m_bit_head += bit_cnt;
+            return word & LowBitsMask( bit_cnt );
+        }
 
         void WriteBits( void *out, size_t bit_cnt );
-        void WriteBits( byte &out, size_t bit_cnt );
+        void WriteBits( byte &out, size_t bit_cnt ) { out = static_cast<byte>( ReadWord( bit_cnt ) ); }
         template <typename T> void Write( T &data, uint32_t bit_cnt = sizeof( T ) * 8 )
         {
             static_assert(std::is_arithmetic<T>::value
@@ -57,40 +175,98 @@ namespace Engine
         void Write( NetworkKey &out );
         void Write( sockaddr &out );
              
-        void Write( uint64_t &out, uint32_t bit_cnt = 64 ) { uint64_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-        void Write(  int64_t &out, uint32_t bit_cnt = 64 ) {  int64_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-                                                                           
-        void Write( uint32_t &out, uint32_t bit_cnt = 32 ) { uint32_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-        void Write(      int &out, uint32_t bit_cnt = 32 ) {  int32_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-                                                                           
-        void Write( uint16_t &out, uint32_t bit_cnt = 16 ) { uint16_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-        void Write(  int16_t &out, uint32_t bit_cnt = 16 ) {  int16_t temp = 0; WriteBits( &temp, bit_cnt ); out = ByteSwap( temp ); }
-                                                                           
-        void Write( bool &out )                            { bool temp = false; WriteBits( &temp, 1 );       out = ByteSwap( temp ); }
-        void Write( uint8_t &out, uint32_t bit_cnt = 8 )   { WriteBits( &out, bit_cnt ); }
-             
-        void Write( float &out )                           { float temp;        WriteBits( &temp, 32 );      out = ByteSwap( temp ); }
-        void Write( double &out )                          { double temp;       WriteBits( &temp, 64 );      out = ByteSwap( temp ); }
+        void Write( uint64_t &out, uint32_t bit_cnt = 64 ) { out = ReadWord( bit_cnt ); }
+        void Write(  int64_t &out, uint32_t bit_cnt = 64 ) { out = static_cast<int64_t>( ReadWord( bit_cnt ) ); }
+
+        void Write( uint32_t &out, uint32_t bit_cnt = 32 ) { out = static_cast<uint32_t>( ReadWord( bit_cnt ) ); }
+        void Write(      int &out, uint32_t bit_cnt = 32 ) { out = static_cast<int32_t>( ReadWord( bit_cnt ) ); }
+
+        void Write( uint16_t &out, uint32_t bit_cnt = 16 ) { out = static_cast<uint16_t>( ReadWord( bit_cnt ) ); }
+        void Write(  int16_t &out, uint32_t bit_cnt = 16 ) { out = static_cast<int16_t>( ReadWord( bit_cnt ) ); }
+
+        void Write( bool &out )                            { out = ReadWord( 1 ) != 0; }
+        void Write( uint8_t &out, uint32_t bit_cnt = 8 )   { out = static_cast<uint8_t>( ReadWord( bit_cnt ) ); }
+
+        void Write( float &out )                           { auto temp = static_cast<uint32_t>( ReadWord( 32 ) ); std::memcpy( &out, &temp, sizeof( out ) ); }
+        void Write( double &out )                          { auto temp = ReadWord( 64 );                          std::memcpy( &out, &temp, sizeof( out ) ); }
+
+        void Write( float &out, const FloatQuantization &quantization ) { out = quantization.Dequantize( static_cast<uint32_t>( ReadWord( quantization.bit_cnt ) ) ); }
+        void Write( float &out, float min, float max, float resolution ) { Write( out, FloatQuantization( min, max, resolution ) ); }
+
+        void Write( Vec2 &out )                            { Write( out.x ); Write( out.y ); }
+        void Write( Vec3 &out )                            { Write( out.x ); Write( out.y ); Write( out.z ); }
+        void Write( Vec2 &out, const FloatQuantization &quantization ) { Write( out.x, quantization ); Write( out.y, quantization ); }
+        void Write( Vec3 &out, const FloatQuantization &quantization ) { Write( out.x, quantization ); Write( out.y, quantization ); Write( out.z, quantization ); }
+        void Write( Quat &out, uint32_t component_bit_cnt = BITSTREAM_QUAT_COMPONENT_BITS );
 
         void WriteBytes( void* out, size_t byte_cnt )      { WriteBits( out, byte_cnt * 8 ); }
 
+        void WriteVarint( uint64_t &out );
+        void WriteGamma( uint32_t &out );
+
+        template <int64_t MIN, int64_t MAX, typename T>
+        void WriteInt( T &out )
+        {
+            static_assert( MIN <= MAX, "WriteInt range is empty" );
+            constexpr int bit_cnt = RangeBitsRequired( MIN, MAX );
+            auto offset = ReadWord( bit_cnt );
+            if( offset > static_cast<uint64_t>( MAX ) - static_cast<uint64_t>( MIN ) )
+            {
+                SetError();
+                offset = 0;
+            }
+
+            out = static_cast<T>( static_cast<int64_t>( static_cast<uint64_t>( MIN ) + offset ) );
+        }
+
     private:
-        InputBitStream( byte *input, const size_t size, bool owned );
+        InputBitStream( byte *input, const size_t size, bool owned, MemoryAllocatorPtr allocator );
+
+        bool m_error;
+
+        uint64_t ReadWordSlow( size_t bit_cnt );
+        void SetError() { m_error = true; m_bit_head = m_bit_capacity; }
     }; typedef std::shared_ptr<InputBitStream> InputBitStreamPtr;
 
+    /* Writes collect in a 64 bit scratch word that is stored to the buffer each time it fills.  Anything still in
+       the scratch word reaches the buffer on Flush, GetBuffer, Collapse, or when a stream over a caller's buffer
+       is destroyed. */
     class OutputBitStream : public BitStreamBase
     {
         friend class BitStreamFactory;
     public:
-        ~OutputBitStream() {};
+        OutputBitStream( byte *output, const size_t size ) : OutputBitStream( output, size, false, nullptr ) {};
+        explicit OutputBitStream( MemoryAllocatorPtr allocator = nullptr ) : OutputBitStream( nullptr, 0, true, allocator ) {};
+        ~OutputBitStream() { if( !m_owned ) Flush(); };
 
+        byte * GetBuffer() { Flush(); return m_buffer; }
         size_t GetCurrentBitCount() { return m_bit_head; }
         size_t GetCurrentByteCount() { return (GetCurrentBitCount() + 7) / 8; }
         size_t GetSize() { return GetCurrentByteCount(); }
         size_t Collapse();
+        void Flush();
+        void Resync();      /* after changing flushed bytes through GetBuffer, e.g. encrypting them in place.  byte aligns the head */
+        void Reset() { m_bit_head = 0; m_scratch = 0; }
+        void Reset( byte *output, const size_t size ) { assert( !m_owned ); Flush(); BindBuffer( output, size ); Reset(); }
+
+        inline void WriteWord( uint64_t value, size_t bit_cnt )
+        {
+            assert( bit_cnt <= 64 );
+            value &= LowBitsMask( bit_cnt );
+            size_t scratch_bits = m_bit_head % 64;
+            m_scratch |= value << scratch_bits;
+            m_bit_head += bit_cnt;
+
+            if( scratch_bits + bit_cnt >= 64 )
+            {
+                /* the scratch word is full, store it and carry over whatever didn't fit */
+                StoreScratch( ( m_bit_head - bit_cnt - scratch_bits ) / 8 );
+                m_scratch = scratch_bits ? value >> ( 64 - scratch_bits ) : 0;
+            }
+        }
 
         void WriteBits( void *out, size_t bit_cnt );
-        void WriteBits( byte &out, size_t bit_cnt );
+        void WriteBits( byte &out, size_t bit_cnt ) { WriteWord( out, bit_cnt ); }
 
         template< typename T >
         void Write( T &data, uint32_t bit_cnt = sizeof( T ) * 8 )
@@ -107,31 +283,66 @@ namespace Engine
         void Write( NetworkAuthentication &out );
         void Write( sockaddr &out );
 
-        void Write( uint64_t out, uint32_t bit_cnt = 64 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
-        void Write(  int64_t out, uint32_t bit_cnt = 64 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
+        void Write( uint64_t out, uint32_t bit_cnt = 64 ) { WriteWord( out, bit_cnt ); }
+        void Write(  int64_t out, uint32_t bit_cnt = 64 ) { WriteWord( static_cast<uint64_t>( out ), bit_cnt ); }
+
+        void Write( uint32_t out, uint32_t bit_cnt = 32 ) { WriteWord( out, bit_cnt ); }
+        void Write(      int out, uint32_t bit_cnt = 32 ) { WriteWord( static_cast<uint32_t>( out ), bit_cnt ); }
 
-        void Write( uint32_t out, uint32_t bit_cnt = 32 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
-        void Write(      int out, uint32_t bit_cnt = 32 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
+        void Write( uint16_t out, uint32_t bit_cnt = 16 ) { WriteWord( out, bit_cnt ); }
+        void Write(  int16_t out, uint32_t bit_cnt = 16 ) { WriteWord( static_cast<uint16_t>( out ), bit_cnt ); }
 
-        void Write( uint16_t out, uint32_t bit_cnt = 16 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
-        void Write(  int16_t out, uint32_t bit_cnt = 16 ) { auto temp = ByteSwap( out ); WriteBits( &temp, bit_cnt ); }
+        void Write( bool out )                            { WriteWord( out ? 1 : 0, 1 ); }
+        void Write( uint8_t out, uint32_t bit_cnt = 8 )   { WriteWord( out, bit_cnt ); }
 
-        void Write( bool out )                            { auto temp = ByteSwap( out ); WriteBits( &temp, 1 ); }
-        void Write( uint8_t out, uint32_t bit_cnt = 8 )   { WriteBits( &out, bit_cnt ); }
+        void Write( float out )                           { uint32_t temp; std::memcpy( &temp, &out, sizeof( temp ) ); WriteWord( temp, 32 ); }
+        void Write( double out )                          { uint64_t temp; std::memcpy( &temp, &out, sizeof( temp ) ); WriteWord( temp, 64 ); }
 
-        void Write( float out )                           { auto temp = ByteSwap( out ); WriteBits( &temp, 32 ); }
-        void Write( double out )                          { auto temp = ByteSwap( out ); WriteBits( &temp, 64 ); }
+        void Write( float out, const FloatQuantization &quantization ) { WriteWord( quantization.Quantize( out ), quantization.bit_cnt ); }
+        void Write( float out, float min, float max, float resolution ) { Write( out, FloatQuantization( min, max, resolution ) ); }
+
+        void Write( Vec2 &out )                           { Write( out.x ); Write( out.y ); }
+        void Write( Vec3 &out )                           { Write( out.x ); Write( out.y ); Write( out.z ); }
+        void Write( Vec2 &out, const FloatQuantization &quantization ) { Write( out.x, quantization ); Write( out.y, quantization ); }
+        void Write( Vec3 &out, const FloatQuantization &quantization ) { Write( out.x, quantization ); Write( out.y, quantization ); Write( out.z, quantization ); }
+        void Write( Quat &out, uint32_t component_bit_cnt = BITSTREAM_QUAT_COMPONENT_BITS );
 
         void WriteBytes( void* out, size_t byte_cnt )     { WriteBits( out, byte_cnt * 8 ); }
 
+        void WriteVarint( uint64_t out );
+        void WriteGamma( uint32_t out );
+
+        template <int64_t MIN, int64_t MAX, typename T>
+        void WriteInt( T out )
+        {
+            static_assert( MIN <= MAX, "WriteInt range is empty" );
+            constexpr int bit_cnt = RangeBitsRequired( MIN, MAX );
+            assert( static_cast<int64_t>( out ) >= MIN && static_cast<int64_t>( out ) <= MAX );
+            WriteWord( static_cast<uint64_t>( static_cast<int64_t>( out ) ) - static_cast<uint64_t>( MIN ), bit_cnt );
+        }
+
     private:
-        OutputBitStream( byte *input, const size_t size, bool owned );
+        OutputBitStream( byte *input, const size_t size, bool owned, MemoryAllocatorPtr allocator );
+
+        uint64_t m_scratch;     /* bits from the last word boundary up to the head */
+
+        inline void StoreScratch( size_t byte_offset )
+        {
+            if( byte_offset + BITSTREAM_WORD_BYTES > GetCapacityBytes() )
+            {
+                Reserve( byte_offset + BITSTREAM_WORD_BYTES );
+            }
+
+            StoreWord( m_buffer + byte_offset, m_scratch );
+        }
+
+        void Reserve( size_t byte_cnt );
     }; typedef std::shared_ptr<OutputBitStream> OutputBitStreamPtr;
 
     class MeasureBitStream : public BitStreamBase
     {
-        friend class BitStreamFactory;
     public:
+        MeasureBitStream() : BitStreamBase( false ) {};
         ~MeasureBitStream() {};
 
         size_t GetCurrentBitCount() { return m_bit_head; }
@@ -170,23 +381,77 @@ namespace Engine
         void Write( float out )                           { m_bit_head += 32; }
         void Write( double out )                          { m_bit_head += 64; }
 
+        void Write( float out, const FloatQuantization &quantization ) { m_bit_head += quantization.bit_cnt; }
+        void Write( float out, float min, float max, float resolution ) { Write( out, FloatQuantization( min, max, resolution ) ); }
+
+        void Write( Vec2 &out )                           { m_bit_head += 2 * 32; }
+        void Write( Vec3 &out )                           { m_bit_head += 3 * 32; }
+        void Write( Vec2 &out, const FloatQuantization &quantization ) { m_bit_head += 2 * quantization.bit_cnt; }
+        void Write( Vec3 &out, const FloatQuantization &quantization ) { m_bit_head += 3 * quantization.bit_cnt; }
+        void Write( Quat &out, uint32_t component_bit_cnt = BITSTREAM_QUAT_COMPONENT_BITS ) { m_bit_head += BITSTREAM_QUAT_INDEX_BITS + 3 * component_bit_cnt; }
+
         void WriteBytes( void* out, size_t byte_cnt )     { WriteBits( out, byte_cnt * 8 ); }
 
-    private:
-        MeasureBitStream() : BitStreamBase( false ) {};
+        void WriteVarint( uint64_t out )                  { m_bit_head += VarintBitsRequired( out ); }
+        void WriteGamma( uint32_t out )                   { m_bit_head += GammaBitsRequired( out ); }
+
+        template <int64_t MIN, int64_t MAX, typename T>
+        void WriteInt( T out )
+        {
+            static_assert( MIN <= MAX, "WriteInt range is empty" );
+            constexpr int bit_cnt = RangeBitsRequired( MIN, MAX );
+            m_bit_head += bit_cnt;
+        }
     }; typedef std::shared_ptr<MeasureBitStream> MeasureBitStreamPtr;
 
     class BitStreamFactory
     {
     public:
-        static OutputBitStreamPtr CreateOutputBitStream( byte *input = nullptr, size_t size = 0, bool owned = true )
+        /* an allocator places both the stream and any buffer it owns in that allocator, e.g. a FrameArena for
+           streams that only live for one tick */
+        static OutputBitStreamPtr CreateOutputBitStream( byte *input = nullptr, size_t size = 0, bool owned = true, MemoryAllocatorPtr allocator = nullptr )
         {
-            return OutputBitStreamPtr( new OutputBitStream( input, size, owned ) );
+            if( !allocator )
+            {
+                return OutputBitStreamPtr( new OutputBitStream( input, size, owned, nullptr ) );
+            }
+
+            auto ptr = allocator->Allocate( sizeof( OutputBitStream ), MEMORY_TAG_NETWORK_BUFFERS );
+            if( !ptr )
+            {
+                return nullptr;
+            }
+
+            return OutputBitStreamPtr( new( ptr ) OutputBitStream( input, size, owned, allocator ), [allocator]( OutputBitStream *p )
+            {
+                p->~OutputBitStream();
+                allocator->Free( p );
+            } );
         }
 
-        static InputBitStreamPtr CreateInputBitStream( byte *input, const size_t size, bool owned = true )
+        static OutputBitStreamPtr CreateOutputBitStream( MemoryAllocatorPtr allocator )
         {
-            return InputBitStreamPtr( new InputBitStream( input, size, owned ) );
+            return CreateOutputBitStream( nullptr, 0, true, allocator );
+        }
+
+        static InputBitStreamPtr CreateInputBitStream( byte *input, const size_t size, bool owned = true, MemoryAllocatorPtr allocator = nullptr )
+        {
+            if( !allocator )
+            {
+                return InputBitStreamPtr( new InputBitStream( input, size, owned, nullptr ) );
+            }
+
+            auto ptr = allocator->Allocate( sizeof( InputBitStream ), MEMORY_TAG_NETWORK_BUFFERS );
+            if( !ptr )
+            {
+                return nullptr;
+            }
+
+            return InputBitStreamPtr( new( ptr ) InputBitStream( input, size, owned, allocator ), [allocator]( InputBitStream *p )
+            {
+                p->~InputBitStream();
+                allocator->Free( p );
+            } );
         }
 
         static MeasureBitStreamPtr CreateMeasureBitStream()
@@ -195,4 +460,3 @@ namespace Engine
         }
     };
 }
-
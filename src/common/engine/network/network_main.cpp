@@ -7,7 +7,8 @@
 
 #define NETWORK_SYSTEM_MEMORY_SIZE ( 1024 * 1014 / 2 )
 
-Engine::Networking::Networking()
+Engine::Networking::Networking() :
+    m_crypto_address_index( 2 * NETWORK_NUM_CRYPO_MAPS )
 {
     Initialize();
 }
@@ -19,7 +20,10 @@ Engine::Networking::~Networking()
 
 void Engine::Networking::Initialize()
 {
-    m_allocator = std::shared_ptr<IMemoryAllocator>( new MemorySystem( NETWORK_SYSTEM_MEMORY_SIZE ) );
+    /* thread cached so packets can be created and released from worker threads */
+    auto heap = MemoryAllocatorPtr( new MemorySystem( NETWORK_SYSTEM_MEMORY_SIZE, MEMORY_SYSTEM_BACKEND_TLSF, L"Networking memory" ) );
+    m_allocator = MemoryAllocatorPtr( new MemoryThreadCachedAllocator( heap ) );
+    m_packet_allocator = NetworkPacketFactory::CreatePacketPools( m_allocator );
 
     /* start WinSock */
     auto result = WSAStartup( MAKEWORD( 2, 2 ), &m_wsa_data );
@@ -28,11 +32,40 @@ void Engine::Networking::Initialize()
         Engine::Log( Engine::LOG_LEVEL_ERROR, L"Networking::Initialize could not initialize Winsock DLL." );
         throw std::runtime_error( "WSAStartup" );
     }
+
+    BuildPacketSalt( NETWORK_SOJOURN_PROTOCOL_ID );
+}
+
+const Engine::NetworkPacketSalt & Engine::Networking::GetPacketSalt( uint64_t protocol_id )
+{
+    if( protocol_id != m_salt_protocol_id )
+    {
+        BuildPacketSalt( protocol_id );
+    }
+
+    return m_salt;
+}
+
+void Engine::Networking::BuildPacketSalt( uint64_t protocol_id )
+{
+    /* only the prefix byte changes from packet to packet, so the rest is built once per protocol */
+    OutputBitStream salt_alias( m_salt.data(), m_salt.size() );
+    salt_alias.WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
+    salt_alias.Write( protocol_id );
+    salt_alias.Write( static_cast<byte>( 0 ) );
+    salt_alias.Flush();
+
+    m_salt_protocol_id = protocol_id;
+}
+
+Engine::NetworkPacketPtr Engine::Networking::ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, NetworkKey &read_key, double now_time )
+{
+    return NetworkPacket::ReadPacket( allocator, read, allowed, protocol_id, GetPacketSalt( protocol_id ), read_key, now_time );
 }
 
 bool Engine::Networking::SendPacket( Engine::NetworkSocketUDPPtr &socket, NetworkAddressPtr &to, NetworkPacketPtr &packet, uint64_t protocol_id, NetworkKey &key, uint64_t sequence_num )
 {
-    auto buffer = packet->WritePacket( sequence_num, protocol_id, key );
+    auto buffer = packet->WritePacket( sequence_num, GetPacketSalt( protocol_id ), key, m_frame_allocator );
     if( !buffer )
     {
         Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Networking::SendPacket unable to write packet." );
@@ -49,35 +82,107 @@ bool Engine::Networking::SendPacket( Engine::NetworkSocketUDPPtr &socket, Networ
     return true;
 }
 
+void Engine::Networking::QueuePacket( NetworkAddressPtr &to, NetworkPacketPtr &packet, uint64_t protocol_id, NetworkKey &key, uint64_t sequence_num, NetworkPacketSentCallback on_sent )
+{
+    m_send_queue.emplace_back();
+    auto &unsealed = m_send_queue.back();
+    packet->WriteUnsealed( sequence_num, GetPacketSalt( protocol_id ), key, unsealed, m_frame_allocator );
+    unsealed.to = to;
+    unsealed.on_sent = on_sent;
+    assert( unsealed.buffer->GetCurrentByteCount() < NETWORK_MAX_PACKET_SIZE );
+}
+
+bool Engine::Networking::SendQueuedPackets( Engine::NetworkSocketUDPPtr &socket )
+{
+    /* each packet is encrypted in its own buffer with its own nonce, so they can be spread over the cores */
+    if( m_send_queue.size() >= NETWORK_PARALLEL_SEAL_MIN_PACKETS )
+    {
+        concurrency::parallel_for( static_cast<size_t>( 0 ), m_send_queue.size(), [this]( size_t i )
+        {
+            (void)m_send_queue[ i ].Seal();
+        } );
+    }
+    else
+    {
+        for( auto &unsealed : m_send_queue )
+        {
+            (void)unsealed.Seal();
+        }
+    }
+
+    auto all_sent = true;
+    for( auto &unsealed : m_send_queue )
+    {
+        if( !unsealed.is_sealed )
+        {
+            Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Networking::SendQueuedPackets unable to write packet." );
+            all_sent = false;
+            continue;
+        }
+
+        if( socket->SendTo( unsealed.buffer->GetBuffer(), unsealed.buffer->GetCurrentByteCount(), unsealed.to ) < 0 )
+        {
+            Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Networking::SendQueuedPackets unable to send packet to destination." );
+            all_sent = false;
+            continue;
+        }
+
+        if( unsealed.on_sent )
+        {
+            unsealed.on_sent();
+        }
+    }
+
+    m_send_queue.clear();
+    return all_sent;
+}
+
 void Engine::Networking::AddCryptoMap( uint64_t client_id, NetworkAddressPtr &client_address, NetworkKey &send_key, NetworkKey &receive_key, double now_time, double expire_time, int timeout_secs )
 {
     auto mapping = m_crypto_map.begin();
     while( mapping != m_crypto_map.end() )
     {
-        auto crypto = mapping->second;
         if( mapping->second->IsExpired( now_time ) )
         {
-            mapping = m_crypto_map.erase( mapping );
+            mapping = EraseCryptoMap( mapping );
             continue;
         }
 
-        if( crypto->address->Matches( *client_address )
-          && mapping->first == client_id )
+        mapping++;
+    }
+
+    /* an address and a client id each have one mapping at a time, a newer one replaces whatever either had */
+    auto packed_address = client_address->Pack();
+    uint64_t address_client_id;
+    if( m_crypto_address_index.Find( packed_address, address_client_id )
+     && address_client_id != client_id )
+    {
+        EraseCryptoMap( m_crypto_map.find( address_client_id ) );
+    }
+
+    auto existing = m_crypto_map.find( client_id );
+    if( existing != m_crypto_map.end() )
+    {
+        auto crypto = existing->second;
+        if( crypto->address->Matches( *client_address ) )
         {
             /* found an existing mapping from this client, so just update it */
             crypto->expire_time = expire_time;
             crypto->timeout_seconds = timeout_secs;
             crypto->last_seen = now_time;
             crypto->send_key = send_key;
-            crypto->receive_key = receive_key;            
+            crypto->receive_key = receive_key;
 
             return;
         }
+
+        EraseCryptoMap( existing );
     }
 
     /* create a new record */
     auto new_record = NetworkCryptoMapPtr( new NetworkCryptoMap() );
     m_crypto_map.insert( std::make_pair( client_id, new_record ) );
+    m_crypto_address_index.Insert( packed_address, client_id );
 
     new_record->address = client_address;
     new_record->expire_time = expire_time;
@@ -90,38 +195,35 @@ void Engine::Networking::AddCryptoMap( uint64_t client_id, NetworkAddressPtr &cl
 
 bool Engine::Networking::DeleteCryptoMapsFromAddress( NetworkAddressPtr &address )
 {
-    bool found = false;
-    auto mapping = m_crypto_map.begin();
-    while( mapping != m_crypto_map.end() )
+    uint64_t client_id;
+    if( !m_crypto_address_index.Find( address->Pack(), client_id ) )
     {
-        auto crypto = mapping->second;
-        if( crypto->address->Matches( *address ) )
-        {
-            found = true;
-            mapping = m_crypto_map.erase( mapping );
-            continue;
-        }
-
-        mapping++;
+        return false;
     }
 
-    return found;
+    EraseCryptoMap( m_crypto_map.find( client_id ) );
+    return true;
 }
 
 Engine::NetworkCryptoMapPtr Engine::Networking::FindCryptoMapByAddress( NetworkAddressPtr &search_address, double time )
 {
-    for( auto mapping : m_crypto_map )
+    uint64_t client_id;
+    if( !m_crypto_address_index.Find( search_address->Pack(), client_id ) )
     {
-        auto crypto = mapping.second;
-        if( !crypto->IsExpired( time )
-          && crypto->address->Matches( *search_address ) )
-        {
-            crypto->last_seen = time;
-            return crypto;
-        }
+        return nullptr;
     }
 
-    return nullptr;
+    auto mapping = m_crypto_map.find( client_id );
+    assert( mapping != m_crypto_map.end() );
+    auto crypto = mapping->second;
+    if( crypto->IsExpired( time ) )
+    {
+        EraseCryptoMap( mapping );
+        return nullptr;
+    }
+
+    crypto->last_seen = time;
+    return crypto;
 }
 
 Engine::NetworkCryptoMapPtr Engine::Networking::FindCryptoMapByClientID( uint64_t search_id, NetworkAddressPtr &expected_address, double time )
@@ -146,11 +248,24 @@ Engine::NetworkCryptoMapPtr Engine::Networking::FindCryptoMapByClientID( uint64_
     return mapping;
 }
 
+std::map<uint64_t, Engine::NetworkCryptoMapPtr>::iterator Engine::Networking::EraseCryptoMap( std::map<uint64_t, NetworkCryptoMapPtr>::iterator mapping )
+{
+    /* the address index has to be kept in step with every removal */
+    assert( mapping != m_crypto_map.end() );
+    m_crypto_address_index.Remove( mapping->second->address->Pack() );
+    return m_crypto_map.erase( mapping );
+}
+
 Engine::MemoryAllocatorPtr Engine::Networking::AsAllocator()
 {
     return m_allocator;
 }
 
+Engine::MemoryAllocatorPtr Engine::Networking::AsPacketAllocator()
+{
+    return m_packet_allocator;
+}
+
 bool Engine::Networking::Encrypt( void *data_to_encrypt, size_t data_length, byte *salt, size_t salt_length, NetworkNonce &nonce, const NetworkKey &key )
 {
     unsigned long long encrypted_length;
@@ -203,13 +318,28 @@ Engine::NetworkingPtr Engine::NetworkingFactory::StartNetworking()
     return( nullptr );
 }
 
+template <typename T>
+T * Engine::NetworkPacketFactory::Construct( MemoryAllocatorPtr &allocator )
+{
+    auto ptr = allocator->Allocate( sizeof( T ), MEMORY_TAG_NETWORK_PACKETS );
+    if( !ptr )
+    {
+        return nullptr;
+    }
+
+    auto packet = new( ptr ) T();
+    packet->BindAllocator( allocator.get() );
+
+    return packet;
+}
+
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateConnectionRequest( MemoryAllocatorPtr allocator, NetworkConnectionRequestHeader &header, NetworkConnectionTokenPtr token )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkConnectionRequestPacket ), L"NetworkPacketFactory::CreateConnectionRequest" );
-    auto packet = std::shared_ptr<NetworkConnectionRequestPacket>( new( ptr ) NetworkConnectionRequestPacket(), [allocator]( NetworkConnectionRequestPacket *p )
+    auto packet = Construct<NetworkConnectionRequestPacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
+        return nullptr;
+    }
 
     packet->header = header;
 
@@ -219,109 +349,121 @@ Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateConnectionRequest(
     }
     else
     {
-        auto token = allocator->Allocate( sizeof( NetworkConnectionToken ), L"NetworkPacketFactory::CreateConnectionRequest" );
+        auto token = allocator->Allocate( sizeof( NetworkConnectionToken ), MEMORY_TAG_NETWORK_TOKENS );
         packet->token = std::shared_ptr<NetworkConnectionToken>( new(token) NetworkConnectionToken(), [allocator]( NetworkConnectionToken *p )
         {
             allocator->Free( p );
         } );
     }
 
-    return packet;
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateConnectionDenied( MemoryAllocatorPtr allocator )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkConnectionDeniedPacket ), L"NetworkPacketFactory::CreateConnectionDenied" );
-    auto packet = std::shared_ptr<NetworkConnectionDeniedPacket>( new(ptr) NetworkConnectionDeniedPacket(), [allocator]( NetworkConnectionDeniedPacket *p )
-    {
-        allocator->Free( p );
-    } );
-
-    return packet;
+    auto packet = Construct<NetworkConnectionDeniedPacket>( allocator );
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateConnectionChallenge( MemoryAllocatorPtr allocator, NetworkConnectionChallengeHeader &header )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkConnectionChallengePacket ), L"NetworkPacketFactory::CreateConnectionChallenge" );
-    auto packet = std::shared_ptr<NetworkConnectionChallengePacket>( new(ptr) NetworkConnectionChallengePacket(), [allocator]( NetworkConnectionChallengePacket *p )
+    auto packet = Construct<NetworkConnectionChallengePacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
-    
+        return nullptr;
+    }
+
     packet->header = header;
 
-    return packet;
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateConnectionChallengeResponse( MemoryAllocatorPtr allocator, NetworkConnectionChallengeResponseHeader &header )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkConnectionChallengeResponsePacket ), L"NetworkPacketFactory::CreateConnectionChallengeResponse" );
-    auto packet = std::shared_ptr<NetworkConnectionChallengeResponsePacket>( new(ptr) NetworkConnectionChallengeResponsePacket(), [allocator]( NetworkConnectionChallengeResponsePacket *p )
+    auto packet = Construct<NetworkConnectionChallengeResponsePacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
+        return nullptr;
+    }
 
     packet->header = header;
     packet->token = NetworkChallengeTokenPtr( new NetworkChallengeToken() );
 
-    return packet;
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateDisconnect( MemoryAllocatorPtr allocator )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkDisconnectPacket ), L"NetworkPacketFactory::CreateDisconnect" );
-    auto packet = std::shared_ptr<NetworkDisconnectPacket>( new(ptr) NetworkDisconnectPacket(), [allocator]( NetworkDisconnectPacket *p )
-    {
-        allocator->Free( p );
-    } );
-
-    return packet;
+    auto packet = Construct<NetworkDisconnectPacket>( allocator );
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateKeepAlive( MemoryAllocatorPtr allocator, NetworkKeepAliveHeader &header )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkKeepAlivePacket ), L"NetworkPacketFactory::CreateKeepAlive" );
-    auto packet = std::shared_ptr<NetworkKeepAlivePacket>( new(ptr) NetworkKeepAlivePacket(), [allocator]( NetworkKeepAlivePacket *p )
+    auto packet = Construct<NetworkKeepAlivePacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
+        return nullptr;
+    }
 
     packet->header = header;
 
-    return packet;
+    return NetworkPacketPtr( packet );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreateKeepAlive( MemoryAllocatorPtr allocator, uint64_t client_id )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkKeepAlivePacket ), L"NetworkPacketFactory::CreateKeepAlive" );
-    auto packet = std::shared_ptr<NetworkKeepAlivePacket>( new(ptr) NetworkKeepAlivePacket(), [allocator]( NetworkKeepAlivePacket *p )
+    auto packet = Construct<NetworkKeepAlivePacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
+        return nullptr;
+    }
 
     packet->header.client_id = client_id;
 
-    return packet;
+    return NetworkPacketPtr( packet );
 }
 
-Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreatePayload( MemoryAllocatorPtr allocator, NetworkPayloadHeader &header, size_t message_bytes )
+Engine::NetworkPacketPtr Engine::NetworkPacketFactory::CreatePayload( MemoryAllocatorPtr allocator, NetworkPayloadHeader &header, byte *message_data, size_t message_bytes )
 {
-    auto ptr = allocator->Allocate( sizeof( NetworkPayloadPacket ), L"NetworkPacketFactory::CreatePayload" );
-    auto packet = std::shared_ptr<NetworkPayloadPacket>( new(ptr) NetworkPayloadPacket(), [allocator]( NetworkPayloadPacket *p )
+    auto packet = Construct<NetworkPayloadPacket>( allocator );
+    if( !packet )
     {
-        allocator->Free( p );
-    } );
+        return nullptr;
+    }
 
     packet->header = header;
+    packet->message_data = message_data;
     packet->message_bytes = message_bytes;
 
-    return packet;
+    return NetworkPacketPtr( packet );
+}
+
+Engine::MemoryAllocatorPtr Engine::NetworkPacketFactory::CreatePacketPools( MemoryAllocatorPtr backing )
+{
+    std::vector<size_t> sizes;
+    sizes.push_back( sizeof( NetworkConnectionRequestPacket ) );
+    sizes.push_back( sizeof( NetworkConnectionDeniedPacket ) );
+    sizes.push_back( sizeof( NetworkConnectionChallengePacket ) );
+    sizes.push_back( sizeof( NetworkConnectionChallengeResponsePacket ) );
+    sizes.push_back( sizeof( NetworkKeepAlivePacket ) );
+    sizes.push_back( sizeof( NetworkDisconnectPacket ) );
+    sizes.push_back( sizeof( NetworkPayloadPacket ) );
+    sizes.push_back( sizeof( NetworkConnectionToken ) );
+
+    return MemoryAllocatorPtr( new MemoryFixedSizePools( backing, sizes ) );
 }
 
-Engine::NetworkPacketPtr Engine::NetworkPacket::ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, NetworkKey &read_key, double now_time )
+Engine::NetworkPacketPtr Engine::NetworkPacket::ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, const NetworkPacketSalt &salt, NetworkKey &read_key, double now_time )
 {
     Engine::NetworkPacketPrefix prefix;
     read->Write( prefix.b );
+    if( read->HasError() )
+    {
+        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Ignored packet.  Packet was empty." );
+        return nullptr;
+    }
+
     if( !allowed.IsAllowed( static_cast<NetworkPacketType>(prefix.packet_type) ) )
     {
         Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Ignored packet.  Type not allowed." );
@@ -354,60 +496,79 @@ Engine::NetworkPacketPtr Engine::NetworkPacket::ReadPacket( MemoryAllocatorPtr a
 
     /* create the nonce */
     NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_number );
+    OutputBitStream nonce_alias( nonce.data(), nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_number );
+    nonce_alias.Flush();
 
-    /* create the salt */
-    struct
-    {
-        byte version[NETWORK_PROTOCOL_VERSION_LEN];
-        uint64_t protocol_id;
-        NetworkPacketPrefix prefix;
-    } salt;
-
-    auto salt_alias = BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>(&salt), sizeof( salt ), false );
-    salt_alias->WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
-    salt_alias->Write( protocol_id );
-    salt_alias->Write( prefix.b );
+    /* finish the salt */
+    auto packet_salt = salt;
+    packet_salt.back() = prefix.b;
 
-    if( !Networking::Decrypt( read->GetBufferAtCurrent(), read->GetRemainingByteCount(), salt_alias->GetBuffer(), salt_alias->GetCurrentByteCount(), nonce, read_key ) )
+    if( !Networking::Decrypt( read->GetBufferAtCurrent(), read->GetRemainingByteCount(), packet_salt.data(), packet_salt.size(), nonce, read_key ) )
     {
         return nullptr;
     }
 
     /* read the packet by packet type */
+    NetworkPacketPtr packet = nullptr;
     switch( prefix.packet_type )
     {
     case PACKET_CONNECT_DENIED:
-        return NetworkConnectionDeniedPacket::Read( allocator, read );
+        packet = NetworkConnectionDeniedPacket::Read( allocator, read );
+        break;
 
     case PACKET_CONNECT_CHALLENGE:
-        return NetworkConnectionChallengePacket::Read( allocator, read );
+        packet = NetworkConnectionChallengePacket::Read( allocator, read );
+        break;
 
     case PACKET_CONNECT_CHALLENGE_RESPONSE:
-        return NetworkConnectionChallengeResponsePacket::Read( allocator, read );
+        packet = NetworkConnectionChallengeResponsePacket::Read( allocator, read );
+        break;
 
     case PACKET_KEEP_ALIVE:
-        return NetworkKeepAlivePacket::Read( allocator, read );
+        packet = NetworkKeepAlivePacket::Read( allocator, read );
+        break;
 
     case PACKET_PAYLOAD:
-        return NetworkPayloadPacket::Read( allocator, read );
+        packet = NetworkPayloadPacket::Read( allocator, read );
+        break;
 
     case PACKET_DISCONNECT:
-        return NetworkDisconnectPacket::Read( allocator, read );
+        packet = NetworkDisconnectPacket::Read( allocator, read );
+        break;
 
     default:
         break;
     }
 
-    return nullptr;
+    if( read->HasError() )
+    {
+        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Ignored Packet.  Packet was truncated." );
+        return nullptr;
+    }
+
+    return packet;
 }
 
-Engine::OutputBitStreamPtr Engine::NetworkPacket::WritePacket( uint64_t sequence_number, uint64_t protocol_id, NetworkKey &key )
+Engine::OutputBitStreamPtr Engine::NetworkPacket::WritePacket( uint64_t sequence_number, const NetworkPacketSalt &salt, NetworkKey &key, MemoryAllocatorPtr scratch )
 {
-    auto out = BitStreamFactory::CreateOutputBitStream();
-   
+    NetworkUnsealedPacket unsealed;
+    WriteUnsealed( sequence_number, salt, key, unsealed, scratch );
+    if( !unsealed.Seal() )
+    {
+        return nullptr;
+    }
+
+    return unsealed.buffer;
+}
+
+void Engine::NetworkPacket::WriteUnsealed( uint64_t sequence_number, const NetworkPacketSalt &salt, NetworkKey &key, NetworkUnsealedPacket &unsealed, MemoryAllocatorPtr scratch )
+{
+    auto out = BitStreamFactory::CreateOutputBitStream( nullptr, NETWORK_MAX_PACKET_SIZE, true, scratch );
+    unsealed.buffer = out;
+    unsealed.is_sealed = false;
+
     /* handle connection requests without encryption */
     if( packet_type == PACKET_CONNECT_REQUEST )
     {
@@ -416,7 +577,9 @@ Engine::OutputBitStreamPtr Engine::NetworkPacket::WritePacket( uint64_t sequence
         prefix.sequence_byte_cnt = 0;
         out->Write( prefix.b );
         Write( out );
-        return out;
+        out->Flush();
+        unsealed.is_encrypted = false;
+        return;
     }
 
     /* encrypted packet */
@@ -429,41 +592,46 @@ Engine::OutputBitStreamPtr Engine::NetworkPacket::WritePacket( uint64_t sequence
     out->Write( prefix.b );
     out->Write( sequence_number, sequence_byte_cnt * 8 );
 
-    /* write the data to be encrypted */
-    auto encrypted = BitStreamFactory::CreateOutputBitStream();
-    Write( encrypted );
+    /* write the data to be encrypted straight after, leaving zeroed room for the authentication */
+    unsealed.encrypted_start = out->GetCurrentByteCount();
+    Write( out );
+
+    NetworkAuthentication authentication = {};
+    out->Write( authentication );
+
+    /* flushed now, so sealing it never needs to grow the buffer */
+    out->Flush();
 
     /* create the nonce */
-    NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_number );
+    OutputBitStream nonce_alias( unsealed.nonce.data(), unsealed.nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_number );
+    nonce_alias.Flush();
 
-    /* create the salt */
-    struct
-    {
-        byte version[NETWORK_PROTOCOL_VERSION_LEN];
-        uint64_t protocol_id;
-        NetworkPacketPrefix prefix;
-    } salt;
+    /* finish the salt */
+    unsealed.salt = salt;
+    unsealed.salt.back() = prefix.b;
 
-    auto salt_alias = BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>( &salt ), sizeof(salt), false );
-    salt_alias->WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
-    salt_alias->Write( protocol_id );
-    salt_alias->Write( prefix.b );
+    unsealed.key = key;
+    unsealed.is_encrypted = true;
+}
 
-    NetworkAuthentication authentication;
-    encrypted->Write( authentication );
+bool Engine::NetworkUnsealedPacket::Seal()
+{
+    if( !is_encrypted )
+    {
+        is_sealed = true;
+        return true;
+    }
 
-    /* encrypt and append to the output packet buffer */
-    if( !Networking::Encrypt( encrypted->GetBuffer(), encrypted->GetCurrentByteCount(), salt_alias->GetBuffer(), salt_alias->GetCurrentByteCount(), nonce, key ) )
+    /* encrypt in place */
+    is_sealed = Networking::Encrypt( buffer->GetBuffer() + encrypted_start, buffer->GetCurrentByteCount() - encrypted_start, salt.data(), salt.size(), nonce, key );
+    if( is_sealed )
     {
-        return nullptr;
+        buffer->Resync();
     }
-    
-    out->WriteBytes( encrypted->GetBuffer(), encrypted->GetSize() );
-    
-    return out;
+
+    return is_sealed;
 }
 
 void Engine::NetworkConnectionRequestPacket::Write( OutputBitStreamPtr &out )
@@ -532,28 +700,26 @@ Engine::NetworkPacketPtr Engine::NetworkConnectionRequestPacket::Read( MemoryAll
 
 bool Engine::NetworkConnectionToken::Read( NetworkConnectionTokenRaw &raw )
 {
-    auto in = Engine::BitStreamFactory::CreateInputBitStream( reinterpret_cast<byte*>(&raw), raw.size(), false );
+    Engine::InputBitStream in( reinterpret_cast<byte*>(&raw), raw.size() );
 
-    in->Write( client_id );
-    in->Write( timeout_seconds );
-    in->Write( server_address_cnt );
-
-    if( server_address_cnt <= 0
-     || server_address_cnt > (int)server_addresses.size() )
+    in.Write( client_id );
+    in.Write( timeout_seconds );
+    in.WriteInt<1, NETCODE_MAX_SERVERS_PER_CONNECT>( server_address_cnt );
+    if( in.HasError() )
     {
         return false;
     }
 
     for( auto i = 0; i < server_address_cnt; i++ )
     {
-        in->Write( server_addresses[i] );
+        in.Write( server_addresses[i] );
     }
 
-    in->Write( client_to_server_key );
-    in->Write( server_to_client_key );
+    in.Write( client_to_server_key );
+    in.Write( server_to_client_key );
 
-    in = Engine::BitStreamFactory::CreateInputBitStream( reinterpret_cast<byte*>(&raw) + raw.size() - sizeof(authentication), sizeof( authentication ), false );
-    in->WriteBytes( authentication.data(), authentication.size() );
+    Engine::InputBitStream authentication_in( reinterpret_cast<byte*>(&raw) + raw.size() - sizeof(authentication), sizeof( authentication ) );
+    authentication_in.WriteBytes( authentication.data(), authentication.size() );
 
     return true;
 }
@@ -561,30 +727,31 @@ bool Engine::NetworkConnectionToken::Read( NetworkConnectionTokenRaw &raw )
 void Engine::NetworkConnectionToken::Write( NetworkConnectionTokenRaw &raw )
 {
     ::ZeroMemory( &raw, sizeof(raw) );
-    auto out = Engine::BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>( &raw ), raw.size(), false );
+    Engine::OutputBitStream out( reinterpret_cast<byte*>( &raw ), raw.size() );
     assert( server_address_cnt > 0 );
     assert( server_address_cnt <= (int)server_addresses.size() );
 
-    out->Write( client_id );
-    out->Write( timeout_seconds );
-    out->Write( server_address_cnt );
+    out.Write( client_id );
+    out.Write( timeout_seconds );
+    out.WriteInt<1, NETCODE_MAX_SERVERS_PER_CONNECT>( server_address_cnt );
     
     for( auto i = 0; i < server_address_cnt; i++ )
     {
-        out->Write( server_addresses[ i ] );
+        out.Write( server_addresses[ i ] );
     }
 
-    out->Write( client_to_server_key );
-    out->Write( server_to_client_key );
+    out.Write( client_to_server_key );
+    out.Write( server_to_client_key );
 }
 
 bool Engine::NetworkConnectionToken::Encrypt( NetworkConnectionTokenRaw &raw, uint64_t sequence_num, uint64_t &protocol_id, double expire_time, const NetworkKey &key )
 {
     /* create the nonce */
     NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_num );
+    OutputBitStream nonce_alias( nonce.data(), nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_num );
+    nonce_alias.Flush();
 
     /* create the salt */
     struct
@@ -594,21 +761,22 @@ bool Engine::NetworkConnectionToken::Encrypt( NetworkConnectionTokenRaw &raw, ui
         double expire_time;
     } salt;
 
-    auto salt_alias = BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>(&salt), sizeof( salt ), false );
-    salt_alias->WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
-    salt_alias->Write( protocol_id );
-    salt_alias->Write( expire_time );
+    OutputBitStream salt_alias( reinterpret_cast<byte*>(&salt), sizeof( salt ) );
+    salt_alias.WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
+    salt_alias.Write( protocol_id );
+    salt_alias.Write( expire_time );
 
-    return Networking::Encrypt( &raw, raw.size(), salt_alias->GetBuffer(), salt_alias->GetCurrentByteCount(), nonce, key );
+    return Networking::Encrypt( &raw, raw.size(), salt_alias.GetBuffer(), salt_alias.GetCurrentByteCount(), nonce, key );
 }
 
 bool Engine::NetworkConnectionToken::Decrypt( NetworkConnectionTokenRaw &raw, uint64_t sequence_num, uint64_t &protocol_id, double expire_time, const NetworkKey &key )
 {
     /* create the nonce */
     NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_num );
+    OutputBitStream nonce_alias( nonce.data(), nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_num );
+    nonce_alias.Flush();
 
     /* create the salt */
     struct
@@ -618,12 +786,12 @@ bool Engine::NetworkConnectionToken::Decrypt( NetworkConnectionTokenRaw &raw, ui
         double expire_time;
     } salt;
 
-    auto salt_alias = BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>(&salt), sizeof( salt ), false );
-    salt_alias->WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
-    salt_alias->Write( protocol_id );
-    salt_alias->Write( expire_time );
+    OutputBitStream salt_alias( reinterpret_cast<byte*>(&salt), sizeof( salt ) );
+    salt_alias.WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
+    salt_alias.Write( protocol_id );
+    salt_alias.Write( expire_time );
 
-    return Networking::Decrypt( &raw, raw.size(), salt_alias->GetBuffer(), salt_alias->GetCurrentByteCount(), nonce, key );
+    return Networking::Decrypt( &raw, raw.size(), salt_alias.GetBuffer(), salt_alias.GetCurrentByteCount(), nonce, key );
 }
 
 Engine::NetworkPacketPtr Engine::NetworkConnectionChallengePacket::Read( MemoryAllocatorPtr allocator, InputBitStreamPtr &in )
@@ -653,19 +821,19 @@ void Engine::NetworkConnectionChallengePacket::Write( OutputBitStreamPtr &out )
 void Engine::NetworkChallengeToken::Write( NetworkChallengeTokenRaw &raw )
 {
     ::ZeroMemory( &raw, sizeof( raw ) );
-    auto out = Engine::BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>(&raw), raw.size(), false );
+    Engine::OutputBitStream out( reinterpret_cast<byte*>(&raw), raw.size() );
 
-    out->Write( client_id );
+    out.Write( client_id );
 }
 
 bool Engine::NetworkChallengeToken::Read( NetworkChallengeTokenRaw &raw )
 {
-    auto in = Engine::BitStreamFactory::CreateInputBitStream( reinterpret_cast<byte*>(&raw), raw.size(), false );
+    Engine::InputBitStream in( reinterpret_cast<byte*>(&raw), raw.size() );
 
-    in->Write( client_id );
+    in.Write( client_id );
 
-    in = Engine::BitStreamFactory::CreateInputBitStream( reinterpret_cast<byte*>(&raw) + raw.size() - sizeof( authentication ), sizeof( authentication ), false );
-    in->WriteBytes( authentication.data(), authentication.size() );
+    Engine::InputBitStream authentication_in( reinterpret_cast<byte*>(&raw) + raw.size() - sizeof( authentication ), sizeof( authentication ) );
+    authentication_in.WriteBytes( authentication.data(), authentication.size() );
 
     return true;
 }
@@ -674,9 +842,10 @@ bool Engine::NetworkChallengeToken::Decrypt( NetworkChallengeTokenRaw &raw, uint
 {
     /* create the nonce */
     NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_num );
+    OutputBitStream nonce_alias( nonce.data(), nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_num );
+    nonce_alias.Flush();
 
     return Networking::Encrypt( &raw, raw.size(), nullptr, 0, nonce, key );
 }
@@ -685,9 +854,10 @@ bool Engine::NetworkChallengeToken::Encrypt( NetworkChallengeTokenRaw &raw, uint
 {
     /* create the nonce */
     NetworkNonce nonce;
-    auto nonce_alias = BitStreamFactory::CreateOutputBitStream( nonce.data(), nonce.size(), false );
-    nonce_alias->Write( 0, 32 );
-    nonce_alias->Write( sequence_num );
+    OutputBitStream nonce_alias( nonce.data(), nonce.size() );
+    nonce_alias.Write( 0, 32 );
+    nonce_alias.Write( sequence_num );
+    nonce_alias.Flush();
 
     return Networking::Encrypt( &raw, raw.size(), nullptr, 0, nonce, key );
 }
@@ -761,27 +931,131 @@ Engine::NetworkPacketPtr Engine::NetworkDisconnectPacket::Read( MemoryAllocatorP
 Engine::NetworkPacketPtr Engine::NetworkPayloadPacket::Read( MemoryAllocatorPtr allocator, InputBitStreamPtr &in )
 {
     NetworkPayloadHeader header;
-    in->Write( header.client_id );
+    in->WriteVarint( header.client_id );
     in->Write( header.sequence );
     in->Write( header.packet_ack_recent_sequence );
     in->Write( header.packet_ack_sequence_bits );
     in->Write( header.start_message );
 
-    auto message_bytes = in->GetRemainingByteCount();
-    in->WriteBytes( header.message_data.data(), message_bytes );
+    /* the authentication trails the messages */
+    if( in->HasError()
+     || in->GetRemainingByteCount() < sizeof( NetworkAuthentication )
+     || in->GetRemainingByteCount() - sizeof( NetworkAuthentication ) > NETWORK_MESSAGE_DATA_RAW_LENGTH )
+    {
+        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Ignored Payload.  Bad packet size %zu.", in->GetSize() );
+        return nullptr;
+    }
 
-    auto packet = NetworkPacketFactory::CreatePayload( allocator, header, message_bytes );
-    auto payload = reinterpret_cast<NetworkPayloadPacket&>( *packet );
+    /* the messages are decoded later straight out of the decrypted receive buffer */
+    auto message_bytes = in->GetRemainingByteCount() - sizeof( NetworkAuthentication );
+    auto message_data = in->GetBufferAtCurrent();
+    in->Advance( static_cast<uint32_t>( 8 * message_bytes ) );
 
-    return packet;
+    return NetworkPacketFactory::CreatePayload( allocator, header, message_data, message_bytes );
 }
 
 void Engine::NetworkPayloadPacket::Write( OutputBitStreamPtr &out )
 {
-    out->Write( header.client_id );
+    out->WriteVarint( header.client_id );
     out->Write( header.sequence );
     out->Write( header.packet_ack_recent_sequence );
     out->Write( header.packet_ack_sequence_bits );
+    out->Write( header.start_message );
+
+    out->WriteBytes( message_data, message_bytes );
+}
+
+Engine::NetworkAddressIndex::NetworkAddressIndex( size_t capacity ) :
+    m_cnt( 0 )
+{
+    size_t slot_cnt = 1;
+    while( slot_cnt < capacity )
+    {
+        slot_cnt <<= 1;
+    }
+
+    m_slots.resize( slot_cnt );
+}
 
-    out->WriteBytes( header.message_data.data(), message_bytes );
+bool Engine::NetworkAddressIndex::Find( uint64_t packed_address, uint64_t &client_id )
+{
+    auto slot = FindSlot( packed_address );
+    if( !m_slots[ slot ].used )
+    {
+        return false;
+    }
+
+    client_id = m_slots[ slot ].client_id;
+    return true;
+}
+
+void Engine::NetworkAddressIndex::Insert( uint64_t packed_address, uint64_t client_id )
+{
+    /* keep the load under three quarters so probe runs stay short */
+    if( 4 * ( m_cnt + 1 ) > 3 * m_slots.size() )
+    {
+        Grow();
+    }
+
+    auto &slot = m_slots[ FindSlot( packed_address ) ];
+    if( !slot.used )
+    {
+        slot.used = true;
+        slot.packed_address = packed_address;
+        m_cnt++;
+    }
+
+    slot.client_id = client_id;
+}
+
+void Engine::NetworkAddressIndex::Remove( uint64_t packed_address )
+{
+    auto mask = m_slots.size() - 1;
+    auto hole = FindSlot( packed_address );
+    if( !m_slots[ hole ].used )
+    {
+        return;
+    }
+
+    /* pull back every later entry in the run that would no longer be reachable past the hole */
+    for( auto next = ( hole + 1 ) & mask; m_slots[ next ].used; next = ( next + 1 ) & mask )
+    {
+        auto home = GetHome( m_slots[ next ].packed_address );
+        if( ( ( next - home ) & mask ) >= ( ( next - hole ) & mask ) )
+        {
+            m_slots[ hole ] = m_slots[ next ];
+            hole = next;
+        }
+    }
+
+    m_slots[ hole ].used = false;
+    m_cnt--;
+}
+
+size_t Engine::NetworkAddressIndex::FindSlot( uint64_t packed_address )
+{
+    /* the slot holding the address, or the empty slot that ends its probe run */
+    auto mask = m_slots.size() - 1;
+    auto slot = GetHome( packed_address );
+    while( m_slots[ slot ].used
+        && m_slots[ slot ].packed_address != packed_address )
+    {
+        slot = ( slot + 1 ) & mask;
+    }
+
+    return slot;
+}
+
+void Engine::NetworkAddressIndex::Grow()
+{
+    std::vector<Slot> old_slots( 2 * m_slots.size() );
+    old_slots.swap( m_slots );
+    m_cnt = 0;
+    for( auto &slot : old_slots )
+    {
+        if( slot.used )
+        {
+            Insert( slot.packed_address, slot.client_id );
+        }
+    }
 }
@@ -19,6 +19,8 @@
 #define NETWORK_FUZZ_LENGTH                  ( 300 )
 #define NETCODE_MAX_SERVERS_PER_CONNECT      ( 32 )
 #define NETWORK_NUM_CRYPO_MAPS               ( 1024 )
+#define NETWORK_PACKET_SALT_LENGTH           ( NETWORK_PROTOCOL_VERSION_LEN + sizeof( uint64_t ) + 1 )   /* version, protocol id, prefix */
+#define NETWORK_PARALLEL_SEAL_MIN_PACKETS    ( 16 )     /* fewer queued packets than this are encrypted on the calling thread */
                                              
 #define NETWORK_PACKET_TYPE_BITS             ( 4 )
 #define NETWORK_SEQUENCE_NUM_BITS            ( 4 )
@@ -113,7 +115,6 @@ namespace Engine
         uint16_t packet_ack_recent_sequence;
         uint32_t packet_ack_sequence_bits;
         uint16_t start_message;
-        NetworkMessageDataRaw message_data;
     };
 #pragma pack(pop)
 
@@ -124,15 +125,36 @@ namespace Engine
     };
 #pragma pack(pop)
     
+    typedef std::array<byte, NETWORK_PACKET_SALT_LENGTH> NetworkPacketSalt;
+    typedef std::function<void()> NetworkPacketSentCallback;
+
+    /* A packet that is written but not yet encrypted, with everything Seal needs to encrypt it in place.  Packets
+       written one at a time can then be encrypted together, see Networking::SendQueuedPackets. */
+    struct NetworkUnsealedPacket
+    {
+        OutputBitStreamPtr buffer;
+        bool is_encrypted;          /* false for connect requests, which are sent as written */
+        size_t encrypted_start;     /* the encrypted part runs from this byte to the end of the buffer */
+        NetworkNonce nonce;
+        NetworkPacketSalt salt;
+        NetworkKey key;
+        NetworkAddressPtr to;
+        bool is_sealed;
+        NetworkPacketSentCallback on_sent;  /* called once the packet is handed to the socket */
+
+        bool Seal();
+    };
+
     class NetworkPacket;
-    typedef std::shared_ptr<NetworkPacket> NetworkPacketPtr;
-    class NetworkPacket
+    typedef MemoryRefPtr<NetworkPacket> NetworkPacketPtr;
+    class NetworkPacket : public MemoryRefCounted
     {
     public:
         NetworkPacketType packet_type;
 
-        static NetworkPacketPtr ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, NetworkKey &read_key, double now_time );
-        OutputBitStreamPtr WritePacket( uint64_t sequence_number, uint64_t protocol_id, NetworkKey &key );
+        static NetworkPacketPtr ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, const NetworkPacketSalt &salt, NetworkKey &read_key, double now_time );
+        OutputBitStreamPtr WritePacket( uint64_t sequence_number, const NetworkPacketSalt &salt, NetworkKey &key, MemoryAllocatorPtr scratch = nullptr );
+        void WriteUnsealed( uint64_t sequence_number, const NetworkPacketSalt &salt, NetworkKey &key, NetworkUnsealedPacket &unsealed, MemoryAllocatorPtr scratch = nullptr );
 
     private:
         virtual void Write( OutputBitStreamPtr &out ) = 0;
@@ -223,13 +245,14 @@ namespace Engine
         friend class NetworkPacketFactory;
     public:
         NetworkPayloadHeader header;
+        byte *message_data;         /* points into the buffer the packet was read from or will be sent from, which must outlive the packet */
         size_t message_bytes;
 
         static NetworkPacketPtr Read( MemoryAllocatorPtr allocator, InputBitStreamPtr &in );
 
     private:
         virtual void Write( OutputBitStreamPtr &out );
-        NetworkPayloadPacket() { packet_type = PACKET_PAYLOAD; message_bytes = 0; }
+        NetworkPayloadPacket() { packet_type = PACKET_PAYLOAD; message_data = nullptr; message_bytes = 0; }
     };
 
     class NetworkPacketFactory
@@ -242,7 +265,48 @@ namespace Engine
         static NetworkPacketPtr CreateDisconnect( MemoryAllocatorPtr allocator );
         static NetworkPacketPtr CreateKeepAlive( MemoryAllocatorPtr allocator, NetworkKeepAliveHeader &header );
         static NetworkPacketPtr CreateKeepAlive( MemoryAllocatorPtr allocator, uint64_t client_id );
-        static NetworkPacketPtr CreatePayload( MemoryAllocatorPtr allocator, NetworkPayloadHeader &header, size_t message_bytes );
+        static NetworkPacketPtr CreatePayload( MemoryAllocatorPtr allocator, NetworkPayloadHeader &header, byte *message_data, size_t message_bytes );
+
+        /* one pool per packet type, for Networking::AsPacketAllocator */
+        static MemoryAllocatorPtr CreatePacketPools( MemoryAllocatorPtr backing );
+
+    private:
+        template <typename T>
+        static T * Construct( MemoryAllocatorPtr &allocator );
+    };
+
+    /* Open addressing index from a packed address to a client id.  Linear probing, and removal shifts the
+       rest of the probe run back, so there are no tombstones to pile up as clients come and go. */
+    class NetworkAddressIndex
+    {
+    public:
+        NetworkAddressIndex( size_t capacity );
+
+        bool Find( uint64_t packed_address, uint64_t &client_id );
+        void Insert( uint64_t packed_address, uint64_t client_id );
+        void Remove( uint64_t packed_address );
+
+    private:
+        struct Slot
+        {
+            uint64_t packed_address;
+            uint64_t client_id;
+            bool used;
+        };
+
+        std::vector<Slot> m_slots;  /* a power of two long */
+        size_t m_cnt;
+
+        size_t FindSlot( uint64_t packed_address );
+        void Grow();
+        inline size_t GetHome( uint64_t packed_address )
+        {
+            /* addresses differ mostly in their low bits, so mix them all into the top before masking */
+            packed_address ^= packed_address >> 33;
+            packed_address *= 0xff51afd7ed558ccdull;
+            packed_address ^= packed_address >> 33;
+            return static_cast<size_t>( packed_address ) & ( m_slots.size() - 1 );
+        }
     };
 
     class NetworkCryptoMap
@@ -282,12 +346,18 @@ namespace Engine
     public:
         ~Networking();
 
+        NetworkPacketPtr ReadPacket( MemoryAllocatorPtr allocator, InputBitStreamPtr &read, NetworkPacketTypesAllowed &allowed, uint64_t protocol_id, NetworkKey &read_key, double now_time );
+        const NetworkPacketSalt & GetPacketSalt( uint64_t protocol_id ); /* builds on first use, so fetch it before reading from other threads */
         bool SendPacket( Engine::NetworkSocketUDPPtr &socket, NetworkAddressPtr &to, NetworkPacketPtr &packet, uint64_t protocol_id, NetworkKey &key, uint64_t sequence_num );
+        void QueuePacket( NetworkAddressPtr &to, NetworkPacketPtr &packet, uint64_t protocol_id, NetworkKey &key, uint64_t sequence_num, NetworkPacketSentCallback on_sent = nullptr );
+        bool SendQueuedPackets( Engine::NetworkSocketUDPPtr &socket );   /* false if any packet could not be sealed or sent */
         void AddCryptoMap( uint64_t client_id, NetworkAddressPtr &client_address, NetworkKey &send_key, NetworkKey &receive_key, double now_time, double expire_time, int timeout_secs );
         bool DeleteCryptoMapsFromAddress( NetworkAddressPtr &address );
         NetworkCryptoMapPtr FindCryptoMapByAddress( NetworkAddressPtr &search_address, double time );
         NetworkCryptoMapPtr FindCryptoMapByClientID( uint64_t search_id, NetworkAddressPtr &expected_address, double time );
         MemoryAllocatorPtr AsAllocator();
+        MemoryAllocatorPtr AsPacketAllocator();
+        void SetFrameAllocator( MemoryAllocatorPtr allocator ) { m_frame_allocator = allocator; }
 
         static bool Encrypt( void *data_to_encrypt, size_t data_length, byte* salt, size_t salt_length, NetworkNonce &nonce, const NetworkKey &key );
         static bool Decrypt( void *data_to_decrypt, size_t data_length, byte *salt, size_t salt_length, NetworkNonce &nonce, const NetworkKey &key );
@@ -297,10 +367,18 @@ namespace Engine
     private:
         WSADATA m_wsa_data;
         std::map<uint64_t, NetworkCryptoMapPtr> m_crypto_map;
+        NetworkAddressIndex m_crypto_address_index;     /* the client id of the crypto map for each address */
         MemoryAllocatorPtr m_allocator;
+        MemoryAllocatorPtr m_packet_allocator;
+        MemoryAllocatorPtr m_frame_allocator; /* scratch for the packet buffers built in SendPacket, or null for the heap */
+        std::vector<NetworkUnsealedPacket> m_send_queue; /* written by QueuePacket, encrypted and sent by SendQueuedPackets */
+        NetworkPacketSalt m_salt;           /* for m_salt_protocol_id, each packet fills in its own prefix byte at the end */
+        uint64_t m_salt_protocol_id;
 
         Networking();
         void Initialize();
+        std::map<uint64_t, NetworkCryptoMapPtr>::iterator EraseCryptoMap( std::map<uint64_t, NetworkCryptoMapPtr>::iterator mapping );
+        void BuildPacketSalt( uint64_t protocol_id );
     }; typedef std::shared_ptr<Networking> NetworkingPtr;
 
     class NetworkingFactory
@@ -5,56 +5,54 @@
 void Engine::NetworkConnectionPassport::Write( NetworkConnectionPassportRaw &raw )
 {
     ::ZeroMemory( &raw, sizeof( raw ) );
-    auto out = Engine::BitStreamFactory::CreateOutputBitStream( reinterpret_cast<byte*>(&raw), raw.size(), false );
+    Engine::OutputBitStream out( reinterpret_cast<byte*>(&raw), raw.size() );
     assert( server_address_cnt > 0 );
     assert( server_address_cnt <= (int)server_addresses.size() );
 
-    out->WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
-    out->Write( protocol_id );
-    out->Write( token_create_time );
-    out->Write( token_expire_time );
-    out->Write( token_sequence );
-    out->Write( timeout_seconds );
-    out->Write( server_address_cnt );
+    out.WriteBytes( (void*)NETWORK_PROTOCOL_VERSION, NETWORK_PROTOCOL_VERSION_LEN );
+    out.Write( protocol_id );
+    out.Write( token_create_time );
+    out.Write( token_expire_time );
+    out.Write( token_sequence );
+    out.Write( timeout_seconds );
+    out.WriteInt<1, NETCODE_MAX_SERVERS_PER_CONNECT>( server_address_cnt );
 
     for( auto i = 0; i < server_address_cnt; i++ )
     {
-        out->Write( server_addresses[ i ] );
+        out.Write( server_addresses[ i ] );
     }
 
-    out->Write( client_to_server_key );
-    out->Write( server_to_client_key );
+    out.Write( client_to_server_key );
+    out.Write( server_to_client_key );
 
-    out->WriteBytes( raw_token.data(), raw_token.size() );
+    out.WriteBytes( raw_token.data(), raw_token.size() );
 }
 
 bool Engine::NetworkConnectionPassport::Read( NetworkConnectionPassportRaw &raw )
 {
-    auto in = Engine::BitStreamFactory::CreateInputBitStream( reinterpret_cast<byte*>(&raw), raw.size(), false );
-
-    in->WriteBytes( version.data(), NETWORK_PROTOCOL_VERSION_LEN );
-    in->Write( protocol_id );
-    in->Write( token_create_time );
-    in->Write( token_expire_time );
-    in->Write( token_sequence );
-    in->Write( timeout_seconds );
-    in->Write( server_address_cnt );
-
-    if( server_address_cnt <= 0
-     || server_address_cnt > (int)server_addresses.size() )
+    Engine::InputBitStream in( reinterpret_cast<byte*>(&raw), raw.size() );
+
+    in.WriteBytes( version.data(), NETWORK_PROTOCOL_VERSION_LEN );
+    in.Write( protocol_id );
+    in.Write( token_create_time );
+    in.Write( token_expire_time );
+    in.Write( token_sequence );
+    in.Write( timeout_seconds );
+    in.WriteInt<1, NETCODE_MAX_SERVERS_PER_CONNECT>( server_address_cnt );
+    if( in.HasError() )
     {
         return false;
     }
 
     for( auto i = 0; i < server_address_cnt; i++ )
     {
-        in->Write( server_addresses[i] );
+        in.Write( server_addresses[i] );
     }
 
-    in->Write( client_to_server_key );
-    in->Write( server_to_client_key );
+    in.Write( client_to_server_key );
+    in.Write( server_to_client_key );
 
-    in->WriteBytes( raw_token.data(), raw_token.size() );
+    in.WriteBytes( raw_token.data(), raw_token.size() );
 
     return true;
 }
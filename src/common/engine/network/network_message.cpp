@@ -2,16 +2,17 @@
 
 #include "network_message.hpp"
 
-class TestMessage : public Engine::NetworkMessage
+class TestMessage : public Engine::NetworkMessageSerializer<TestMessage>
 {
     friend class Engine::NetworkMessageFactory;
 public:
+    static const bool FIXED_SIZE = true;
 
     SERIALIZE_MAPPING()
     {
-        stream->Write( a );
-        stream->Write( b );
-        stream->Write( c );
+        stream.Write( a );
+        stream.Write( b );
+        stream.Write( c );
     }
 
 private:
@@ -19,9 +20,126 @@ private:
     int b;
     int c;
 
-    TestMessage() : NetworkMessage( Engine::MESSAGE_TEST ) { a = 0; b = 0; c = 0; }
+    TestMessage() : NetworkMessageSerializer( Engine::MESSAGE_TEST ) { a = 0; b = 0; c = 0; }
 };
 
+namespace
+{
+    /* bits [start, end) of a recorded field */
+    inline void GetFieldRange( Engine::OutputBitStream &stream, Engine::NetworkFieldRecorder &fields, size_t field, size_t &start, size_t &end )
+    {
+        start = fields.field_starts[ field ];
+        end = field + 1 < std::min<size_t>( fields.field_cnt, NETWORK_MESSAGE_MAX_FIELDS + 1 ) ? fields.field_starts[ field + 1 ] : stream.GetCurrentBitCount();
+    }
+
+    bool FieldsMatch( Engine::InputBitStream &a, size_t a_start, size_t a_end, Engine::InputBitStream &b, size_t b_start, size_t b_end )
+    {
+        if( a_end - a_start != b_end - b_start )
+        {
+            return false;
+        }
+
+        a.SeekToLocation( a_start );
+        b.SeekToLocation( b_start );
+        for( auto remaining = a_end - a_start; remaining > 0; )
+        {
+            auto chunk_bits = std::min<size_t>( remaining, BITSTREAM_WORD_MAX_BITS );
+            if( a.ReadWord( chunk_bits ) != b.ReadWord( chunk_bits ) )
+            {
+                return false;
+            }
+
+            remaining -= chunk_bits;
+        }
+
+        return true;
+    }
+
+    void CopyBits( Engine::OutputBitStream &write, Engine::InputBitStream &read, size_t start, size_t end )
+    {
+        read.SeekToLocation( start );
+        for( auto remaining = end - start; remaining > 0; )
+        {
+            auto chunk_bits = std::min<size_t>( remaining, BITSTREAM_WORD_MAX_BITS );
+            write.WriteWord( read.ReadWord( chunk_bits ), chunk_bits );
+            remaining -= chunk_bits;
+        }
+    }
+}
+
+Engine::NetworkMessageBaseline::NetworkMessageBaseline( NetworkMessage &message ) :
+    message_type( message.message_type ),
+    fields( bits )
+{
+    message.RecordFields( fields );
+    bits.Flush();
+}
+
+Engine::NetworkDeltaReader::NetworkDeltaReader( InputBitStream &read, InputBitStream &baseline, NetworkFieldRecorder &baseline_fields ) :
+    m_read( read ),
+    m_baseline( baseline ),
+    m_baseline_fields( baseline_fields ),
+    m_changed( 0 ),
+    m_mask_bit_cnt( std::min<size_t>( baseline_fields.field_cnt, NETWORK_MESSAGE_MAX_FIELDS ) ),
+    m_field( 0 )
+{
+    m_read.Write( m_changed, static_cast<uint32_t>( m_mask_bit_cnt ) );
+}
+
+Engine::InputBitStream & Engine::NetworkDeltaReader::NextField()
+{
+    auto field = m_field++;
+    if( field >= m_mask_bit_cnt
+     || ( m_changed >> field ) & 1 )
+    {
+        return m_read;
+    }
+
+    m_baseline.SeekToLocation( m_baseline_fields.field_starts[ field ] );
+    return m_baseline;
+}
+
+void Engine::NetworkMessageDelta::Write( OutputBitStream &write, OutputBitStream &current, NetworkFieldRecorder &current_fields, OutputBitStream &baseline, NetworkFieldRecorder &baseline_fields )
+{
+    InputBitStream current_read( current.GetBuffer(), current.GetSize() );
+    InputBitStream baseline_read( baseline.GetBuffer(), baseline.GetSize() );
+
+    /* a bit for each of the baseline's fields, set where this message's field differs */
+    auto mask_bit_cnt = std::min<size_t>( baseline_fields.field_cnt, NETWORK_MESSAGE_MAX_FIELDS );
+    uint64_t changed = 0;
+    for( size_t i = 0; i < mask_bit_cnt && i < current_fields.field_cnt; i++ )
+    {
+        size_t current_start, current_end, baseline_start, baseline_end;
+        GetFieldRange( current, current_fields, i, current_start, current_end );
+        GetFieldRange( baseline, baseline_fields, i, baseline_start, baseline_end );
+        if( !FieldsMatch( current_read, current_start, current_end, baseline_read, baseline_start, baseline_end ) )
+        {
+            changed |= static_cast<uint64_t>( 1 ) << i;
+        }
+    }
+
+    write.Write( changed, static_cast<uint32_t>( mask_bit_cnt ) );
+
+    /* then the changed fields, and everything past the mask */
+    for( size_t i = 0; i < current_fields.field_cnt && i < NETWORK_MESSAGE_MAX_FIELDS; i++ )
+    {
+        if( i < mask_bit_cnt
+         && !( ( changed >> i ) & 1 ) )
+        {
+            continue;
+        }
+
+        size_t start, end;
+        GetFieldRange( current, current_fields, i, start, end );
+        CopyBits( write, current_read, start, end );
+    }
+
+    if( current_fields.field_cnt > NETWORK_MESSAGE_MAX_FIELDS )
+    {
+        CopyBits( write, current_read, current_fields.field_starts[ NETWORK_MESSAGE_MAX_FIELDS ], current.GetCurrentBitCount() );
+    }
+}
+
 Engine::NetworkMessagePtr Engine::NetworkMessageFactory::CreateMessage( NetworkMessageTypeId id )
 {
     switch( id )
@@ -34,15 +152,32 @@ Engine::NetworkMessagePtr Engine::NetworkMessageFactory::CreateMessage( NetworkM
     return nullptr;
 }
 
-Engine::NetworkMessagePtr Engine::NetworkMessageFactory::CreateMessage( InputBitStreamPtr &read )
+Engine::NetworkMessagePtr Engine::NetworkMessageFactory::CreateMessage( InputBitStream &read, NetworkMessageBaseline *baseline )
 {
-    auto marker = read->SaveCurrentLocation();
+    auto marker = read.SaveCurrentLocation();
     NetworkMessageTypeId message_type;
-    read->Write( message_type, read->BitsRequired( Engine::MESSAGE_TYPE_CNT ) );
-    read->SeekToLocation( marker );
+    read.WriteInt<0, MESSAGE_TYPE_CNT - 1>( message_type );
+    read.SeekToLocation( marker );
+    if( read.HasError()
+     || ( baseline && baseline->message_type != message_type ) )
+    {
+        return nullptr;
+    }
 
     auto message = Engine::NetworkMessageFactory::CreateMessage( message_type );
-    message->Serialize( read );
+    if( baseline )
+    {
+        message->Serialize( read, *baseline );
+    }
+    else
+    {
+        message->Serialize( read );
+    }
+
+    if( read.HasError() )
+    {
+        return nullptr;
+    }
 
     return message;
 }
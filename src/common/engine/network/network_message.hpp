@@ -2,27 +2,29 @@
 
 #include "network_buffers.hpp"
 
+/* Messages list their fields once, in a template that every stream type instantiates:
+
+       class MyMessage : public Engine::NetworkMessageSerializer<MyMessage>
+       {
+       public:
+           SERIALIZE_MAPPING()
+           {
+               stream.Write( a );
+           }
+       };
+
+   Field writes are inlined per stream type, leaving one virtual call per message.
+
+   A message that carries state, e.g. one entity's position, overrides GetBaselineKey to name that state.  It is
+   then sent as a delta against the newest message with the same type and key that the peer has acked: a mask with
+   a bit for each of the baseline's fields, then only the fields whose bits changed.  Each Write call in the
+   mapping is one field, and fields past NETWORK_MESSAGE_MAX_FIELDS are always sent. */
 #define SERIALIZE_MAPPING()                                                                \
-    virtual void Serialize( Engine::MeasureBitStreamPtr &measure )                         \
-    {                                                                                      \
-        measure->Write( message_type, measure->BitsRequired( Engine::MESSAGE_TYPE_CNT ) ); \
-        __Serialize( measure );                                                            \
-    }                                                                                      \
-                                                                                           \
-    virtual void Serialize( Engine::InputBitStreamPtr &read )                              \
-    {                                                                                      \
-        read->Write( message_type, read->BitsRequired( Engine::MESSAGE_TYPE_CNT ) );       \
-        __Serialize( read );                                                               \
-    }                                                                                      \
-                                                                                           \
-    virtual void Serialize( Engine::OutputBitStreamPtr &write )                            \
-    {                                                                                      \
-        write->Write( message_type, write->BitsRequired( Engine::MESSAGE_TYPE_CNT ) );     \
-        __Serialize( write );                                                              \
-    }                                                                                      \
-                                                                                           \
     template <typename T>                                                                  \
-    void __Serialize( T &stream )
+    void SerializeFields( T &stream )
+
+#define NETWORK_MESSAGE_MAX_FIELDS         ( 64 )
+#define NETWORK_MESSAGE_DELTA_MAX_BYTES    ( 1100 )    /* messages larger than this are always sent whole */
 
 namespace Engine
 {
@@ -32,12 +34,20 @@ namespace Engine
         MESSAGE_TYPE_CNT
     } NetworkMessageTypeId;
 
+    class NetworkFieldRecorder;
+    class NetworkMessageBaseline;
+
     class NetworkMessage
     {
     public:
-        virtual void Serialize( MeasureBitStreamPtr &measure ) = 0;
-        virtual void Serialize( InputBitStreamPtr &read ) = 0;
-        virtual void Serialize( OutputBitStreamPtr &write ) = 0;
+        virtual void Serialize( MeasureBitStream &measure ) = 0;
+        virtual void Serialize( InputBitStream &read ) = 0;
+        virtual void Serialize( OutputBitStream &write ) = 0;
+        virtual void Serialize( InputBitStream &read, NetworkMessageBaseline &baseline ) = 0;
+        virtual void Serialize( OutputBitStream &write, NetworkMessageBaseline &baseline ) = 0;
+        virtual void RecordFields( NetworkFieldRecorder &fields ) = 0;
+        virtual size_t GetBitCount() = 0;
+        virtual bool GetBaselineKey( uint32_t & ) { return false; }
 
         NetworkMessageTypeId message_type;
 
@@ -45,11 +55,148 @@ namespace Engine
         NetworkMessage( NetworkMessageTypeId id ) : message_type( id ) {};
     }; typedef std::shared_ptr<NetworkMessage> NetworkMessagePtr;
 
+    /* Forwards each field of a message to the stream Derived::NextField() picks for it */
+    template <class Derived, class Stream>
+    class NetworkFieldStream
+    {
+    public:
+        template <typename... Args> void Write( Args&&... args )       { NextField().Write( std::forward<Args>( args )... ); }
+        template <typename... Args> void WriteBits( Args&&... args )   { NextField().WriteBits( std::forward<Args>( args )... ); }
+        template <typename... Args> void WriteBytes( Args&&... args )  { NextField().WriteBytes( std::forward<Args>( args )... ); }
+        template <typename... Args> void WriteVarint( Args&&... args ) { NextField().WriteVarint( std::forward<Args>( args )... ); }
+        template <typename... Args> void WriteGamma( Args&&... args )  { NextField().WriteGamma( std::forward<Args>( args )... ); }
+        template <int64_t MIN, int64_t MAX, typename T> void WriteInt( T &&value ) { NextField().template WriteInt<MIN, MAX>( value ); }
+
+    private:
+        Stream & NextField() { return static_cast<Derived*>( this )->NextField(); }
+    };
+
+    /* writes the fields and notes the bit where each starts */
+    class NetworkFieldRecorder : public NetworkFieldStream<NetworkFieldRecorder, OutputBitStream>
+    {
+    public:
+        NetworkFieldRecorder( OutputBitStream &stream ) : field_cnt( 0 ), m_stream( stream ) {};
+
+        OutputBitStream & NextField()
+        {
+            if( field_cnt <= NETWORK_MESSAGE_MAX_FIELDS )
+            {
+                field_starts[ field_cnt ] = m_stream.GetCurrentBitCount();
+            }
+
+            field_cnt++;
+            return m_stream;
+        }
+
+        std::array<size_t, NETWORK_MESSAGE_MAX_FIELDS + 1> field_starts;
+        size_t field_cnt;
+
+    private:
+        OutputBitStream &m_stream;
+    };
+
+    /* a message's fields written out once with the bit where each starts, so every delta against the message
+       reads them rather than serializing it again */
+    class NetworkMessageBaseline
+    {
+    public:
+        NetworkMessageBaseline( NetworkMessage &message );
+
+        NetworkMessageTypeId message_type;
+        OutputBitStream bits;
+        NetworkFieldRecorder fields;
+    }; typedef std::shared_ptr<NetworkMessageBaseline> NetworkMessageBaselinePtr;
+
+    /* reads changed fields from the packet and the rest from the baseline's recorded fields */
+    class NetworkDeltaReader : public NetworkFieldStream<NetworkDeltaReader, InputBitStream>
+    {
+    public:
+        NetworkDeltaReader( InputBitStream &read, InputBitStream &baseline, NetworkFieldRecorder &baseline_fields );
+
+        InputBitStream & NextField();
+
+    private:
+        InputBitStream &m_read;
+        InputBitStream &m_baseline;
+        NetworkFieldRecorder &m_baseline_fields;
+        uint64_t m_changed;
+        size_t m_mask_bit_cnt;
+        size_t m_field;
+    };
+
+    class NetworkMessageDelta
+    {
+    public:
+        static void Write( OutputBitStream &write, OutputBitStream &current, NetworkFieldRecorder &current_fields, OutputBitStream &baseline, NetworkFieldRecorder &baseline_fields );
+    };
+
+    /* GetBitCount measures each message.  Messages whose fields always write the same number of bits may declare
+       static const bool FIXED_SIZE = true to measure the type once, debug builds check each message against it */
+    template <class MessageType>
+    class NetworkMessageSerializer : public NetworkMessage
+    {
+    public:
+        static const bool FIXED_SIZE = false;
+
+        void Serialize( MeasureBitStream &measure ) override { SerializeMessage( measure ); }
+        void Serialize( InputBitStream &read ) override      { SerializeMessage( read ); }
+        void Serialize( OutputBitStream &write ) override    { SerializeMessage( write ); }
+
+        void Serialize( InputBitStream &read, NetworkMessageBaseline &baseline ) override
+        {
+            read.WriteInt<0, MESSAGE_TYPE_CNT - 1>( message_type );
+            InputBitStream baseline_read( baseline.bits.GetBuffer(), baseline.bits.GetSize() );
+            NetworkDeltaReader fields( read, baseline_read, baseline.fields );
+            static_cast<MessageType*>( this )->SerializeFields( fields );
+        }
+
+        void Serialize( OutputBitStream &write, NetworkMessageBaseline &baseline ) override
+        {
+            assert( GetBitCount() <= 8 * NETWORK_MESSAGE_DELTA_MAX_BYTES );
+            std::array<byte, NETWORK_MESSAGE_DELTA_MAX_BYTES> current_buffer;
+            OutputBitStream current( current_buffer.data(), current_buffer.size() );
+            NetworkFieldRecorder current_fields( current );
+            RecordFields( current_fields );
+
+            write.WriteInt<0, MESSAGE_TYPE_CNT - 1>( message_type );
+            NetworkMessageDelta::Write( write, current, current_fields, baseline.bits, baseline.fields );
+        }
+
+        void RecordFields( NetworkFieldRecorder &fields ) override { static_cast<MessageType*>( this )->SerializeFields( fields ); }
+        size_t GetBitCount() override                        { return GetBitCount( std::integral_constant<bool, MessageType::FIXED_SIZE>() ); }
+
+    protected:
+        NetworkMessageSerializer( NetworkMessageTypeId id ) : NetworkMessage( id ) {};
+
+    private:
+        template <typename T>
+        void SerializeMessage( T &stream )
+        {
+            stream.template WriteInt<0, MESSAGE_TYPE_CNT - 1>( message_type );
+            static_cast<MessageType*>( this )->SerializeFields( stream );
+        }
+
+        size_t MeasureBitCount()
+        {
+            MeasureBitStream measure;
+            SerializeMessage( measure );
+            return measure.GetCurrentBitCount();
+        }
+
+        size_t GetBitCount( std::true_type )
+        {
+            static const size_t bit_cnt = MeasureBitCount();
+            assert( bit_cnt == MeasureBitCount() );
+            return bit_cnt;
+        }
+
+        size_t GetBitCount( std::false_type ) { return MeasureBitCount(); }
+    };
+
     class NetworkMessageFactory
     {
     public:
         static NetworkMessagePtr CreateMessage( NetworkMessageTypeId id );
-        static NetworkMessagePtr CreateMessage( InputBitStreamPtr &read );
+        static NetworkMessagePtr CreateMessage( InputBitStream &read, NetworkMessageBaseline *baseline = nullptr );
     };
 }
-
@@ -8,6 +8,7 @@ Engine::NetworkReliableEndpoint::NetworkReliableEndpoint() :
     received_message_start_sequence( 0 ),
     round_trip_time( 0.2 )
 {
+    decoded_messages.reserve( NETWORK_MAX_MESSAGES_PER_PACKET );
 }
 
 bool Engine::NetworkReliableEndpoint::ProcessReceivedPackets( double now_time )
@@ -16,20 +17,29 @@ bool Engine::NetworkReliableEndpoint::ProcessReceivedPackets( double now_time )
     {
         auto packet = in_queue.front();
         in_queue.pop();
-        auto payload = reinterpret_cast<NetworkPayloadPacket&>( *packet );
+        auto &payload = reinterpret_cast<NetworkPayloadPacket&>( *packet );
         if( !received_packet_buffer.IsValidSequence( payload.header.sequence ) )
         {
             Engine::Log( Engine::LOG_LEVEL_DEBUG, L"NetworkReliableEndpoint::ProcessReceivedPackets ignored a packet with an out of date sequence." );
             continue;
         }
 
+        /* the packet is only acked once all of its messages decode, otherwise it is dropped and the messages are resent */
+        decoded_messages.clear();
+        if( payload.message_bytes
+         && !DecodeMessages( payload.header.start_message, payload.message_data, payload.message_bytes ) )
+        {
+            continue;
+        }
+
         auto &received_packet_info = received_packet_buffer.Insert( payload.header.sequence );
         received_packet_info.time_received = now_time;
 
-        AckPackets( payload.header.packet_ack_recent_sequence, payload.header.packet_ack_sequence_bits, payload.header.start_message, now_time );
-        if( payload.message_bytes 
-         && !ReceiveMessages( payload.header.start_message, payload.header.message_data.data(), payload.message_bytes ) )
+        AckPackets( payload.header.packet_ack_recent_sequence, payload.header.packet_ack_sequence_bits, now_time );
+        if( !ReceiveMessages( payload.header.start_message ) )
         {
+            /* the rest of the queue points into buffers that only live until the end of the tick */
+            in_queue = std::queue<Engine::NetworkPacketPtr>();
             return false;
         }
     }
@@ -41,11 +51,14 @@ bool Engine::NetworkReliableEndpoint::ProcessReceivedPackets( double now_time )
 
 void Engine::NetworkReliableEndpoint::PackageOutgoingPackets( MemoryAllocatorPtr allocator, uint64_t client_id, double now_time )
 {
+    out_queue.clear();
     if( !out_messages.size() )
     {
         return;
     }
 
+    PruneSentBaselines();
+
     NetworkPayloadHeader header;
     header.client_id = client_id;
     header.sequence = sent_packet_buffer.next_sequence;
@@ -53,41 +66,61 @@ void Engine::NetworkReliableEndpoint::PackageOutgoingPackets( MemoryAllocatorPtr
     header.packet_ack_sequence_bits = received_packet_buffer.GenerateAckBits();
     header.start_message = out_messages.front().sequence;
 
-    auto write   = BitStreamFactory::CreateOutputBitStream( header.message_data.data(), header.message_data.size(), false );
-    auto measure = BitStreamFactory::CreateMeasureBitStream();
-    
-    out_queue.clear();
 
     out_queue.emplace_back();
     out_queue.back().messages.cnt = 0;
+    OutputBitStream write( out_queue.back().message_data.data(), out_queue.back().message_data.size() );
     for( auto message : out_messages )
     {
         if( message.last_sent_time + NETWORK_MESSAGE_SEND_PERIOD / 1000.0 > now_time )
             continue;
 
-        measure->Reset();
-        measure->Write( message.sequence );
-        message.message->Serialize( measure );
+        /* fixed size messages know their size without being serialized, so each message is written once.  a delta
+           is never more than the whole message and its mask.  each message follows a set bit, and a clear bit after
+           the last one ends the payload, so room for it is always kept */
+        uint16_t relative_sequence = message.sequence - header.start_message;
+        auto baseline = FindSentBaseline( message );
+        uint16_t baseline_distance = baseline ? message.sequence - baseline->sequence : 0;
+        auto bit_cnt = 1 + BitStreamBase::GammaBitsRequired( relative_sequence ) + 1 + message.message->GetBitCount() + 1;
+        if( baseline )
+        {
+            bit_cnt += BitStreamBase::GammaBitsRequired( baseline_distance - 1 ) + NETWORK_MESSAGE_MAX_FIELDS;
+        }
 
-        if( write->GetCurrentByteCount() + measure->GetCurrentByteCount() > header.message_data.size()
+        if( write.GetCurrentBitCount() + bit_cnt > 8 * out_queue.back().message_data.size()
          || out_queue.back().messages.cnt == out_queue.back().messages.sequences.size() )
         {
-            out_queue.back().packet = Engine::NetworkPacketFactory::CreatePayload( allocator, header, write->GetCurrentByteCount() );
+            write.Write( false );
+            write.Flush();
+            out_queue.back().packet = Engine::NetworkPacketFactory::CreatePayload( allocator, header, out_queue.back().message_data.data(), write.GetCurrentByteCount() );
             sent_packet_buffer.next_sequence++;
             header.sequence = sent_packet_buffer.next_sequence;
             out_queue.emplace_back();
             out_queue.back().messages.cnt = 0;
-            write->Reset();
+            write.Reset( out_queue.back().message_data.data(), out_queue.back().message_data.size() );
+        }
+
+        write.Write( true );
+        write.WriteGamma( relative_sequence );
+        write.Write( baseline != nullptr );
+        if( baseline )
+        {
+            write.WriteGamma( baseline_distance - 1 );
+            message.message->Serialize( write, *baseline->baseline );
+        }
+        else
+        {
+            message.message->Serialize( write );
         }
 
-        write->Write( message.sequence - header.start_message );
-        message.message->Serialize( write );
         out_queue.back().messages.sequences[ out_queue.back().messages.cnt++ ] = message.sequence;
     }
 
     if( out_queue.back().messages.cnt > 0 )
     {
-        out_queue.back().packet = Engine::NetworkPacketFactory::CreatePayload( allocator, header, write->GetCurrentByteCount() );
+        write.Write( false );
+        write.Flush();
+        out_queue.back().packet = Engine::NetworkPacketFactory::CreatePayload( allocator, header, out_queue.back().message_data.data(), write.GetCurrentByteCount() );
         sent_packet_buffer.next_sequence++;
     }
     else
@@ -98,7 +131,7 @@ void Engine::NetworkReliableEndpoint::PackageOutgoingPackets( MemoryAllocatorPtr
 
 void Engine::NetworkReliableEndpoint::MarkSent( OutgoingPacket &packet, double now_time )
 {
-    auto payload = reinterpret_cast<NetworkPayloadPacket&>( *packet.packet );
+    auto &payload = reinterpret_cast<NetworkPayloadPacket&>( *packet.packet );
     auto &info = sent_packet_buffer.Insert( payload.header.sequence );
     
     info.was_acked = false;
@@ -129,18 +162,19 @@ Engine::NetworkMessagePtr Engine::NetworkReliableEndpoint::PopIncomingMessage()
     return message;
 }
 
-void Engine::NetworkReliableEndpoint::AckPackets( uint16_t ack_sequence, uint32_t ack_bits, uint16_t start_message_sequence, double now_time )
+void Engine::NetworkReliableEndpoint::AckPackets( uint16_t ack_sequence, uint32_t ack_bits, double now_time )
 {
-    int flag = 1;
+    uint32_t flag = 1;
     for( auto i = 0; i < 32; i++ )
     {
         uint16_t sequence = ack_sequence - (uint16_t)i;
-        if( ack_bits & flag )
+        if( ( ack_bits & flag )
+         && sent_packet_buffer.Exists( sequence ) )
         {
             auto &sent_packet_info = sent_packet_buffer.GetInfo( sequence );
             if( !sent_packet_info.was_acked )
             {
-                RemoveAckedOutgoingMessages( start_message_sequence, sent_packet_info.messages );
+                RemoveAckedOutgoingMessages( sent_packet_info.messages );
             }
 
             sent_packet_info.was_acked = true;
@@ -151,11 +185,11 @@ void Engine::NetworkReliableEndpoint::AckPackets( uint16_t ack_sequence, uint32_
     }
 }
 
-void Engine::NetworkReliableEndpoint::RemoveAckedOutgoingMessages( uint16_t start_sequence, MessageSequenceArray &messages )
+void Engine::NetworkReliableEndpoint::RemoveAckedOutgoingMessages( MessageSequenceArray &messages )
 {
     for( auto i = 0; i < messages.cnt; i++ )
     {
-        uint16_t sequence = start_sequence + messages.sequences[ i ];
+        uint16_t sequence = messages.sequences[ i ];
         auto it = std::find_if( out_messages.begin(), out_messages.end(), [sequence]( QueuedMessage const& msg )
         {
             return msg.sequence == sequence;
@@ -163,34 +197,170 @@ void Engine::NetworkReliableEndpoint::RemoveAckedOutgoingMessages( uint16_t star
 
         if( it != out_messages.end() )
         {
+            UpdateSentBaseline( *it );
             out_messages.erase( it );
         }
     }
     
 }
 
-bool Engine::NetworkReliableEndpoint::ReceiveMessages( uint16_t start_sequence, byte *message_data, size_t message_data_size )
+Engine::NetworkReliableEndpoint::SentBaseline * Engine::NetworkReliableEndpoint::FindSentBaseline( QueuedMessage &message )
 {
-    auto read = BitStreamFactory::CreateInputBitStream( message_data, message_data_size, false );
-    while( read->GetRemainingByteCount() )
+    uint32_t key;
+    if( !message.message->GetBaselineKey( key ) )
     {
-        uint16_t sequence;
-        read->Write( sequence );
-        sequence += start_sequence;
-                
-        if( !received_message_buffer.Exists( sequence ) )
+        return nullptr;
+    }
+
+    auto it = sent_baselines.find( static_cast<uint64_t>( message.message->message_type ) << 32 | key );
+    if( it == sent_baselines.end() )
+    {
+        return nullptr;
+    }
+
+    /* the peer's receive window follows the newest message we sent, a baseline that fell out of it is gone for good */
+    if( IsSentBaselineStale( it->second ) )
+    {
+        sent_baselines.erase( it );
+        return nullptr;
+    }
+
+    /* the baseline has to be older than the message */
+    uint16_t distance = message.sequence - it->second.sequence;
+    if( distance == 0
+     || distance >= NETWORK_SEQUENCE_BUFFER_LENGTH / 2
+     || message.message->GetBitCount() > 8 * NETWORK_MESSAGE_DELTA_MAX_BYTES )
+    {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+bool Engine::NetworkReliableEndpoint::IsSentBaselineStale( SentBaseline &baseline )
+{
+    return static_cast<uint16_t>( next_message_sequence - 1 - baseline.sequence ) >= NETWORK_SEQUENCE_BUFFER_LENGTH / 2;
+}
+
+void Engine::NetworkReliableEndpoint::PruneSentBaselines()
+{
+    /* keys that stop being sent, e.g. despawned entities, would otherwise keep their baselines for good */
+    auto it = sent_baselines.begin();
+    while( it != sent_baselines.end() )
+    {
+        if( IsSentBaselineStale( it->second ) )
         {
-            if( received_message_buffer.SequenceLessThan( sequence, received_message_start_sequence ) )
+            it = sent_baselines.erase( it );
+            continue;
+        }
+
+        it++;
+    }
+}
+
+void Engine::NetworkReliableEndpoint::UpdateSentBaseline( QueuedMessage &message )
+{
+    uint32_t key;
+    if( !message.message->GetBaselineKey( key ) )
+    {
+        return;
+    }
+
+    auto &baseline = sent_baselines[ static_cast<uint64_t>( message.message->message_type ) << 32 | key ];
+    if( !baseline.baseline
+     || sent_packet_buffer.SequenceGreaterThan( message.sequence, baseline.sequence ) )
+    {
+        baseline.baseline = NetworkMessageBaselinePtr( new NetworkMessageBaseline( *message.message ) );
+        baseline.sequence = message.sequence;
+    }
+}
+
+bool Engine::NetworkReliableEndpoint::DecodeMessages( uint16_t start_sequence, byte *message_data, size_t message_data_size )
+{
+    /* messages are decoded even when they were already received, to step over them.  a set bit comes before
+       each message and a clear bit ends the payload, since a delta can be shorter than the padding */
+    InputBitStream read( message_data, message_data_size );
+    bool has_message;
+    read.Write( has_message );
+    while( has_message )
+    {
+        uint32_t relative_sequence;
+        read.WriteGamma( relative_sequence );
+        uint16_t sequence = start_sequence + static_cast<uint16_t>( relative_sequence );
+
+        /* the sender only deltas against messages we acked, so the baseline should be here.  if it is not, the
+           packet is dropped unacked and the message comes again */
+        NetworkMessageBaselinePtr baseline = nullptr;
+        bool has_baseline;
+        read.Write( has_baseline );
+        if( has_baseline )
+        {
+            uint32_t baseline_distance;
+            read.WriteGamma( baseline_distance );
+            uint16_t baseline_sequence = sequence - static_cast<uint16_t>( baseline_distance + 1 );
+            if( received_message_buffer.Exists( baseline_sequence ) )
             {
-                Engine::Log( Engine::LOG_LEVEL_ERROR, L"NetworkReliableEndpoint::ReceiveMessages message receive sequence buffer is corrupted!" );
+                auto &info = received_message_buffer.GetInfo( baseline_sequence );
+                if( info.baseline
+                 && !info.recorded_baseline )
+                {
+                    info.recorded_baseline = NetworkMessageBaselinePtr( new NetworkMessageBaseline( *info.baseline ) );
+                }
+
+                baseline = info.recorded_baseline;
+            }
+
+            if( !baseline )
+            {
+                Engine::Log( Engine::LOG_LEVEL_DEBUG, L"NetworkReliableEndpoint::DecodeMessages ignored a packet with a missing message baseline." );
                 return false;
             }
+        }
+
+        auto message = Engine::NetworkMessageFactory::CreateMessage( read, baseline.get() );
+        if( !message
+         || decoded_messages.size() == NETWORK_MAX_MESSAGES_PER_PACKET )
+        {
+            Engine::Log( Engine::LOG_LEVEL_DEBUG, L"NetworkReliableEndpoint::DecodeMessages ignored a packet with a malformed message." );
+            return false;
+        }
+
+        decoded_messages.push_back( { message, sequence } );
+        read.Write( has_message );
+    }
+
+    if( read.HasError() )
+    {
+        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"NetworkReliableEndpoint::DecodeMessages ignored a truncated packet." );
+        return false;
+    }
+
+    return true;
+}
+
+bool Engine::NetworkReliableEndpoint::ReceiveMessages( uint16_t start_sequence )
+{
+    for( auto &decoded : decoded_messages )
+    {
+        if( received_message_buffer.Exists( decoded.sequence ) )
+        {
+            continue;
+        }
 
-            auto &info = received_message_buffer.Insert( sequence );
-            info.message = Engine::NetworkMessageFactory::CreateMessage( read );
+        if( received_message_buffer.SequenceLessThan( decoded.sequence, received_message_start_sequence ) )
+        {
+            Engine::Log( Engine::LOG_LEVEL_ERROR, L"NetworkReliableEndpoint::ReceiveMessages message receive sequence buffer is corrupted!" );
+            return false;
         }
+
+        uint32_t key;
+        auto &info = received_message_buffer.Insert( decoded.sequence );
+        info.message = decoded.message;
+        info.baseline = decoded.message->GetBaselineKey( key ) ? decoded.message : nullptr;
+        info.recorded_baseline.reset();
     }
 
+    decoded_messages.clear();
     if( received_message_buffer.SequenceGreaterThan( start_sequence, received_message_start_sequence ) )
     {
         received_message_start_sequence = start_sequence;
@@ -25,8 +25,8 @@ namespace Engine
 
         inline bool SequenceLessThan( uint16_t a, uint16_t b )
         {
-            return ( a < b && b - a <  0x00ff )
-                || ( b < a && a - b >= 0x00ff );
+            return ( a < b && b - a <  0x8000 )
+                || ( b < a && a - b >= 0x8000 );
         }
 
         inline bool SequenceGreaterThan( uint16_t a, uint16_t b )
@@ -46,7 +46,12 @@ namespace Engine
                 to += 0xffff;
             }
 
-            assert( to - from < (int)entries.size() );
+            /* a gap longer than the buffer clears all of it */
+            if( to - from >= (int)entries.size() )
+            {
+                from = to - (int)entries.size() + 1;
+            }
+
             for( auto i = from; i <= to; i++ )
             {
                 Remove( i );
@@ -55,7 +60,7 @@ namespace Engine
 
         inline bool IsValidSequence( uint16_t test )
         {
-            return SequenceLessThan( test, next_sequence - (uint16_t)entries.size() );
+            return !SequenceLessThan( test, next_sequence - (uint16_t)entries.size() );
         }
 
         PacketInfoType & Insert( uint16_t sequence )
@@ -121,6 +126,7 @@ namespace Engine
         {
             MessageSequenceArray messages;
             Engine::NetworkPacketPtr packet;
+            NetworkMessageDataRaw message_data;     /* the packet's messages point here, deque elements never move */
         } OutgoingPacket;
 
         NetworkReliableEndpoint();
@@ -131,8 +137,8 @@ namespace Engine
         void PushOutgoingMessage( NetworkMessagePtr message );
         NetworkMessagePtr PopIncomingMessage();
 
-        std::deque<OutgoingPacket> out_queue;
-        std::queue<Engine::NetworkPacketPtr> in_queue;
+        std::deque<OutgoingPacket> out_queue;            /* the packets of the last PackageOutgoingPackets, kept until the next */
+        std::queue<Engine::NetworkPacketPtr> in_queue;   /* payloads may point into per-tick buffers, ProcessReceivedPackets always empties it */
         double round_trip_time;
 
     private:
@@ -165,19 +171,45 @@ namespace Engine
         uint32_t next_message_sequence;
         std::vector<QueuedMessage> out_messages;
 
-        /* message receive */
+        /* newest acked message for each message type and baseline key */
+        typedef struct
+        {
+            NetworkMessageBaselinePtr baseline;
+            uint16_t sequence;
+        } SentBaseline;
+
+        std::unordered_map<uint64_t, SentBaseline> sent_baselines;
+
+        /* message receive, a message with a baseline key stays as the baseline after it is popped and has its
+           fields recorded the first time a delta needs them */
         typedef struct
         {
             NetworkMessagePtr message;
+            NetworkMessagePtr baseline;
+            NetworkMessageBaselinePtr recorded_baseline;
         } ReceivedMessageInfo;
 
         SequenceBuffer<ReceivedMessageInfo, NETWORK_SEQUENCE_BUFFER_LENGTH> received_message_buffer;
         uint16_t received_message_start_sequence;
         std::queue<NetworkMessagePtr> in_messages;
 
-        void AckPackets( uint16_t ack_sequence, uint32_t ack_bits, uint16_t start_message_sequence, double now_time );
-        void RemoveAckedOutgoingMessages( uint16_t start_sequence, MessageSequenceArray &messages );
-        bool ReceiveMessages( uint16_t start_sequence, byte *message_data, size_t message_data_size );
+        /* the messages of the packet being received, kept until the whole packet decodes */
+        typedef struct
+        {
+            NetworkMessagePtr message;
+            uint16_t sequence;
+        } DecodedMessage;
+
+        std::vector<DecodedMessage> decoded_messages;
+
+        void AckPackets( uint16_t ack_sequence, uint32_t ack_bits, double now_time );
+        void RemoveAckedOutgoingMessages( MessageSequenceArray &messages );
+        SentBaseline * FindSentBaseline( QueuedMessage &message );
+        bool IsSentBaselineStale( SentBaseline &baseline );
+        void PruneSentBaselines();
+        void UpdateSentBaseline( QueuedMessage &message );
+        bool DecodeMessages( uint16_t start_sequence, byte *message_data, size_t message_data_size );
+        bool ReceiveMessages( uint16_t start_sequence );
         void QueueNewReceivedMessages();
         void UpdateRTT( double single_rtt );
 
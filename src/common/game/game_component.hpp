@@ -46,7 +46,7 @@ namespace Game
         {
         public:
             GameComponentContainer( Engine::MemoryAllocatorPtr &allocator ) :
-                Engine::MemoryChunkAllocator<T, GAME_COMPONENTS_PER_CHUNK>( allocator, L"GameComponentContainer" )
+                Engine::MemoryChunkAllocator<T, GAME_COMPONENTS_PER_CHUNK>( allocator, Engine::MEMORY_TAG_GAME_COMPONENTS )
             {}
 
             virtual void DestroyComponent( IGameComponent *component )
@@ -64,7 +64,7 @@ namespace Game
         T* AddComponent( GameEntityId entity_id, ARGS... args )
         {
             assert( m_entity_components.size() < entity_id.m_index + 1 || m_entity_components[ entity_id.m_index ][ T::COMPONENT_TYPE ] == nullptr );
-            auto container = GetComponentContainer<T>();
+            auto &container = GetComponentContainer<T>();
             auto memory = container.Allocate();
 
             T *new_component = new(memory) T( std::forward<ARGS>( args )... );
@@ -85,7 +85,7 @@ namespace Game
                 return;
             }
 
-            auto container = GetComponentContainer<T>();
+            auto &container = GetComponentContainer<T>();
             container.DestroyComponent( component );
             component = nullptr;
         }
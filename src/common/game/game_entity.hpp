@@ -57,7 +57,7 @@ namespace Game
         {
         public:
             GameEntityContainer( Engine::MemoryAllocatorPtr &allocator ) :
-                Engine::MemoryChunkAllocator<T, GAME_ENTITIES_PER_CHUNK>( allocator, L"GameEntityContainer" )
+                Engine::MemoryChunkAllocator<T, GAME_ENTITIES_PER_CHUNK>( allocator, Engine::MEMORY_TAG_GAME_ENTITIES )
             {}
 
             virtual void DestroyEntity( IGameEntity *entity )
@@ -76,7 +76,7 @@ namespace Game
         template <typename T, typename ...ARGS>
         GameEntityId CreateEntity( ARGS... args )
         {
-            auto container = GetEntityContainer<T>();
+            auto &container = GetEntityContainer<T>();
             auto memory = container.Allocate();
             auto entity_id = GetNewUID( reinterpret_cast<IGameEntity*>( memory ) );
 
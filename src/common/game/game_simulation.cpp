@@ -23,7 +23,7 @@ public:
 
 Game::GameSimulation::GameSimulation()
 {
-    m_ecs_memory = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( GAME_ECS_MEMORY_SIZE ) );
+    m_ecs_memory = Engine::MemoryAllocatorPtr( new Engine::MemorySystem( GAME_ECS_MEMORY_SIZE, Engine::MEMORY_SYSTEM_BACKEND_TLSF, L"ECS memory" ) );
 
     m_component_manager = GameComponentManagerPtr( new GameComponentManager( m_ecs_memory ) );
     m_entity_manager = GameEntityManagerPtr( new GameEntityManager( m_ecs_memory, m_component_manager ) );
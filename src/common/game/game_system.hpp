@@ -64,7 +64,7 @@ namespace Game
             m_systems.emplace( std::make_pair( T::SYSTEM_TYPE, GameSystemEntry() ) );
             auto &entry = m_systems[ T::SYSTEM_TYPE ];
 
-            auto memory = m_allocator->Allocate( sizeof( T ), L"GameSystemManager" );
+            auto memory = m_allocator->Allocate( sizeof( T ), Engine::MEMORY_TAG_GAME_SYSTEMS );
             reinterpret_cast<IGameSystem*>( memory )->m_entity_manager = &*m_entity_manager;
             reinterpret_cast<IGameSystem*>( memory )->m_component_manager = &*m_component_manager;
 
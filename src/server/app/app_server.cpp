@@ -13,8 +13,22 @@ Server::Application::Application( std::wstring server_address ) :
 {
 }
 
+void Server::Application::AssertFrameArenaUnreferenced()
+{
+#if defined( _DEBUG )
+    /* received payloads point into the datagrams read into the frame arena, so they must all be consumed */
+    assert( m_received.empty() );
+    for( auto &client : m_clients )
+    {
+        assert( client->endpoint->in_queue.empty() );
+    }
+#endif
+}
+
 void Server::Application::CheckClientTimeouts()
 {
+    /* DisconnectClient erases from m_clients, so disconnect after the loop */
+    std::vector<uint64_t> timed_out;
     for( auto client : m_clients )
     {
         if( client->timeout_seconds <= 0
@@ -25,7 +39,12 @@ void Server::Application::CheckClientTimeouts()
 
         /* client has timeout out.  haven't recieved a packet from them in a while.  disconnect them */
         Engine::Log( Engine::LOG_LEVEL_INFO, L"Server found Client ID %d has timed out.", client->client_id );
-        DisconnectClient( client->client_id, 0 );
+        timed_out.push_back( client->client_id );
+    }
+
+    for( auto client_id : timed_out )
+    {
+        DisconnectClient( client_id, 0 );
     }
 }
 
@@ -51,7 +70,7 @@ void Server::Application::DisconnectClient( uint64_t client_id, int num_of_disco
     if( num_of_disconnect_packets > 0 )
     {
         auto crypto = m_networking->FindCryptoMapByClientID( client_id, client->client_address, m_now_time );
-        auto packet = Engine::NetworkPacketFactory::CreateDisconnect( m_networking->AsAllocator() );
+        auto packet = Engine::NetworkPacketFactory::CreateDisconnect( m_frame_arena );
         for( auto i = 0; i < num_of_disconnect_packets; i++ )
         {
             m_networking->SendPacket( m_socket, client->client_address, packet, m_config.protocol_id, crypto->send_key, client->client_sequence++ );
@@ -96,13 +115,20 @@ Server::ClientRecordPtr Server::Application::FindClientByClientID( uint64_t sear
 
 void Server::Application::HandleGamePacketsFromClients()
 {
+    /* DisconnectClient erases from m_clients, so disconnect after the loop */
+    std::vector<uint64_t> failed;
     for( auto client : m_clients )
     {
         if( !client->endpoint->ProcessReceivedPackets( m_now_time ) )
         {
-            DisconnectClient( client->client_id );
+            failed.push_back( client->client_id );
         }
     }
+
+    for( auto client_id : failed )
+    {
+        DisconnectClient( client_id );
+    }
 }
 
 void Server::Application::KeepClientsAlive()
@@ -114,7 +140,7 @@ void Server::Application::KeepClientsAlive()
             continue;
         }
 
-        auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_networking->AsAllocator(), client->client_id );
+        auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_frame_arena, client->client_id );
         if( !SendClientPacket( client->client_id, packet ) )
         {
             Engine::Log( Engine::LOG_LEVEL_WARNING, L"Server::KeepClientsAlive not able to send client %d keep alive packet.", client->client_id );
@@ -165,7 +191,7 @@ void Server::Application::OnReceivedConnectionChallengeResponse( Engine::Network
     if( m_clients.size() == m_config.max_num_clients )
     {
         Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server Connection Challenge response denied.  Server is full. Sending denied response..." );
-        auto refusal = Engine::NetworkPacketFactory::CreateConnectionDenied( m_networking->AsAllocator() );
+        auto refusal = Engine::NetworkPacketFactory::CreateConnectionDenied( m_frame_arena );
         (void)m_networking->SendPacket( m_socket, from, refusal, m_config.protocol_id, crypto->send_key, m_next_sequence++ );
         return;
     }
@@ -185,7 +211,7 @@ void Server::Application::OnReceivedConnectionChallengeResponse( Engine::Network
     Engine::Log( Engine::LOG_LEVEL_INFO, L"Server connected Client ID %d", response.token->client_id );
 
     /* let the client know the connection was accepted by sending a keep alive packet */
-    auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_networking->AsAllocator(), response.token->client_id );
+    auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_frame_arena, response.token->client_id );
     (void)SendClientPacket( response.token->client_id, packet );
 }
 
@@ -229,7 +255,7 @@ void Server::Application::OnReceivedConnectionRequest( Engine::NetworkConnection
     if( m_clients.size() == m_config.max_num_clients )
     {
         Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server Connection Request denied.  Server is full. Sending denied response..." );
-        auto refusal = Engine::NetworkPacketFactory::CreateConnectionDenied( m_networking->AsAllocator() );
+        auto refusal = Engine::NetworkPacketFactory::CreateConnectionDenied( m_frame_arena );
         (void)m_networking->SendPacket( m_socket, from, refusal, m_config.protocol_id, connect_token->server_to_client_key, m_next_sequence++ );
         return;
     }
@@ -252,7 +278,7 @@ void Server::Application::OnReceivedConnectionRequest( Engine::NetworkConnection
     challenge_token.Write( challenge.raw_challenge_token );
     Engine::NetworkChallengeToken::Encrypt( challenge.raw_challenge_token, challenge.token_sequence, m_config.challenge_key );
 
-    auto challenge_packet = Engine::NetworkPacketFactory::CreateConnectionChallenge( m_networking->AsAllocator(), challenge );
+    auto challenge_packet = Engine::NetworkPacketFactory::CreateConnectionChallenge( m_frame_arena, challenge );
     if( !m_networking->SendPacket( m_socket, from, challenge_packet, m_config.protocol_id, connect_token->server_to_client_key, challenge.token_sequence ) )
     {
         Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server unable to send a connection challenge to %s.", from->Print().c_str() );
@@ -298,6 +324,12 @@ void Server::Application::ProcessPacket( Engine::NetworkPacketPtr &packet, Engin
         break;
 
     case Engine::PACKET_PAYLOAD:
+        if( !client )
+        {
+            Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server Payload ignored.  Could not find a matching client." );
+            break;
+        }
+
         client->endpoint->in_queue.push( packet );
         break;
 
@@ -306,36 +338,25 @@ void Server::Application::ProcessPacket( Engine::NetworkPacketPtr &packet, Engin
     }
 }
 
-void Server::Application::ReadAndProcessPacket( uint64_t protocol_id, Engine::NetworkPacketTypesAllowed &allowed, Engine::NetworkAddressPtr &from, Engine::InputBitStreamPtr &read )
+void Server::Application::ReadDatagram( ReceivedDatagram &datagram, Engine::MemoryAllocatorPtr &allocator, Engine::NetworkPacketTypesAllowed &allowed, const Engine::NetworkPacketSalt &salt )
 {
-    Engine::NetworkCryptoMapPtr crypto;
-    auto client = FindClientByAddress( from );
-    if( client )
-    {
-        crypto = m_networking->FindCryptoMapByClientID( client->client_id, from, m_now_time );
-    }
-    else
-    {
-        crypto = m_networking->FindCryptoMapByAddress( from, m_now_time );
-    }
-
-    auto marker = read->SaveCurrentLocation();
+    /* may run on a worker thread, so it only touches its own datagram */
+    auto marker = datagram.read->SaveCurrentLocation();
     Engine::NetworkPacketPrefix prefix;
-    read->Write( prefix.b );
-    read->SeekToLocation( marker );
+    datagram.read->Write( prefix.b );
+    datagram.read->SeekToLocation( marker );
 
     if( prefix.packet_type != Engine::PACKET_CONNECT_REQUEST
-        && !crypto )
+        && !datagram.crypto )
     {
-        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server packet ignored.  No encryption mapping exists for %s.", from->Print().c_str() );
+        Engine::Log( Engine::LOG_LEVEL_DEBUG, L"Server packet ignored.  No encryption mapping exists for %s.", datagram.from->Print().c_str() );
         return;
     }
 
-    auto packet = Engine::NetworkPacket::ReadPacket( m_networking->AsAllocator(), read, allowed, protocol_id, crypto->receive_key, m_now_time );
-    if( packet )
-    {
-        ProcessPacket( packet, from, client );
-    }
+    /* connection requests are not encrypted with a session key */
+    Engine::NetworkKey no_key = {};
+    auto &read_key = datagram.crypto ? datagram.crypto->receive_key : no_key;
+    datagram.packet = Engine::NetworkPacket::ReadPacket( allocator, datagram.read, allowed, m_config.protocol_id, salt, read_key, m_now_time );
 }
 
 void Server::Application::ReceivePackets()
@@ -347,17 +368,73 @@ void Server::Application::ReceivePackets()
     allowed.SetAllowed( Engine::PACKET_PAYLOAD );
     allowed.SetAllowed( Engine::PACKET_DISCONNECT );
 
-    byte data[ NETWORK_MAX_PACKET_SIZE ];
-    while( true )
+    /* take the waiting datagrams off the socket and match them to their client and keys here, the client list
+       and crypto map are not thread safe */
+    while( m_received.size() < SERVER_RECEIVE_BATCH_SIZE )
     {
+        /* payload packets keep pointing at their decrypted messages until the endpoint processes them this tick */
+        auto data = static_cast<byte*>( m_frame_arena->Allocate( NETWORK_MAX_PACKET_SIZE, Engine::MEMORY_TAG_NETWORK_BUFFERS ) );
+        if( !data )
+            break;
+
         Engine::NetworkAddressPtr from;
-        auto byte_cnt = m_socket->ReceiveFrom( data, sizeof( data ), from );
+        auto byte_cnt = m_socket->ReceiveFrom( data, NETWORK_MAX_PACKET_SIZE, from );
         if( byte_cnt == 0 )
             break;
 
-        auto read = Engine::BitStreamFactory::CreateInputBitStream( data, byte_cnt, false );
-        ReadAndProcessPacket( m_config.protocol_id, allowed, from, read );
+        ReceivedDatagram datagram;
+        datagram.from = from;
+        datagram.read = Engine::BitStreamFactory::CreateInputBitStream( data, byte_cnt, false, m_frame_arena );
+        datagram.client = FindClientByAddress( from );
+        if( datagram.client )
+        {
+            datagram.crypto = m_networking->FindCryptoMapByClientID( datagram.client->client_id, from, m_now_time );
+        }
+        else
+        {
+            datagram.crypto = m_networking->FindCryptoMapByAddress( from, m_now_time );
+        }
+
+        m_received.push_back( datagram );
     }
+
+    /* decrypting and decoding each datagram is independent of the others.  the packet pools are not thread
+       safe, so the packets come from the thread cached networking allocator */
+    auto &salt = m_networking->GetPacketSalt( m_config.protocol_id );
+    auto allocator = m_networking->AsAllocator();
+    if( m_received.size() >= SERVER_PARALLEL_READ_MIN_PACKETS )
+    {
+        concurrency::parallel_for( static_cast<size_t>( 0 ), m_received.size(), [&]( size_t i )
+        {
+            ReadDatagram( m_received[ i ], allocator, allowed, salt );
+        } );
+    }
+    else
+    {
+        for( auto &datagram : m_received )
+        {
+            ReadDatagram( datagram, allocator, allowed, salt );
+        }
+    }
+
+    /* then handle them in the order they arrived.  a challenge response earlier in the batch may have connected
+       the client since it was looked up */
+    for( auto &datagram : m_received )
+    {
+        if( !datagram.packet )
+        {
+            continue;
+        }
+
+        if( !datagram.client )
+        {
+            datagram.client = FindClientByAddress( datagram.from );
+        }
+
+        ProcessPacket( datagram.packet, datagram.from, datagram.client );
+    }
+
+    m_received.clear();
 }
 
 int Server::Application::Run()
@@ -375,6 +452,14 @@ int Server::Application::Run()
             RunGameSimulation();
             SendGamePacketsToClients();
             KeepClientsAlive();
+            if( !m_networking->SendQueuedPackets( m_socket ) )
+            {
+                Engine::Log( Engine::LOG_LEVEL_WARNING, L"Server could not send all of this tick's packets." );
+            }
+
+            /* nothing allocated from the frame arena may outlive the tick */
+            AssertFrameArenaUnreferenced();
+            m_frame_arena->Reset();
         } );
     }
 
@@ -387,7 +472,7 @@ void Server::Application::RunGameSimulation()
     m_simulation->RunFrame( (float)m_timer.GetElapsedSeconds() );
 }
 
-bool Server::Application::SendClientPacket( uint64_t client_id, Engine::NetworkPacketPtr &packet )
+bool Server::Application::SendClientPacket( uint64_t client_id, Engine::NetworkPacketPtr &packet, Engine::NetworkPacketSentCallback on_sent /*=nullptr*/ )
 {
     auto client = FindClientByClientID( client_id );
     if( !client )
@@ -403,11 +488,8 @@ bool Server::Application::SendClientPacket( uint64_t client_id, Engine::NetworkP
         return false;
     }
 
-    if( !m_networking->SendPacket( m_socket, client->client_address, packet, m_config.protocol_id, crypto->send_key, client->client_sequence++ ) )
-    {
-        Engine::Log( Engine::LOG_LEVEL_WARNING, L"Server::SendClientPacket failed to send packet to client %d.", client_id );
-        return false;
-    }
+    /* sent with the rest of the tick's packets in SendQueuedPackets, which calls on_sent if it gets out */
+    m_networking->QueuePacket( client->client_address, packet, m_config.protocol_id, crypto->send_key, client->client_sequence++, on_sent );
 
     client->last_time_sent_packet = m_now_time;
     return true;
@@ -420,24 +502,22 @@ void Server::Application::SendGamePacketsToClients()
         /* if the client is not confirmed connected yet, send a keep alive packet to establish the connection, until we received our first packet from them */
         if( !client->is_confirmed )
         {
-            auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_networking->AsAllocator(), client->client_id );
+            auto packet = Engine::NetworkPacketFactory::CreateKeepAlive( m_frame_arena, client->client_id );
             (void)SendClientPacket( client->client_id, packet );
         }
 
-        client->endpoint->PackageOutgoingPackets( m_networking->AsAllocator(), client->client_id, m_now_time );
-        while( client->endpoint->out_queue.size() )
+        /* out_queue keeps the packets until the next tick's PackageOutgoingPackets, so each is only marked sent
+           once SendQueuedPackets has handed it to the socket */
+        auto endpoint = client->endpoint;
+        auto now_time = m_now_time;
+        endpoint->PackageOutgoingPackets( m_networking->AsPacketAllocator(), client->client_id, m_now_time );
+        for( auto &outgoing : endpoint->out_queue )
         {
-            auto &outgoing = client->endpoint->out_queue.front();
-            if( !SendClientPacket( client->client_id, outgoing.packet ) )
+            auto sent = &outgoing;
+            if( !SendClientPacket( client->client_id, outgoing.packet, [endpoint, sent, now_time]() { endpoint->MarkSent( *sent, now_time ); } ) )
             {
                 Engine::Log( Engine::LOG_LEVEL_WARNING, L"Server::SendGamePacketsToClients failed to send packet to client %d.", client->client_id );
             }
-            else
-            {
-                client->endpoint->MarkSent( outgoing, m_now_time );
-            }
-
-            client->endpoint->out_queue.pop_front();
         }
 
     }
@@ -446,8 +526,12 @@ void Server::Application::SendGamePacketsToClients()
 void Server::Application::Shutdown()
 {
     wprintf( L"Shutting down\n" );
+
+    /* client endpoints still hold packets, which must go back to the networking pools before those are destroyed */
+    m_clients.clear();
     m_simulation.reset();
     m_networking.reset();
+    m_frame_arena.reset();
 }
 
 bool Server::Application::Start()
@@ -464,6 +548,10 @@ bool Server::Application::Start()
         return false;
     }
 
+    m_frame_arena = Engine::FrameArenaPtr( new Engine::FrameArena( SERVER_FRAME_ARENA_SIZE ) );
+    m_networking->SetFrameAllocator( m_frame_arena );
+    m_received.reserve( SERVER_RECEIVE_BATCH_SIZE );
+
     m_now_time = Engine::Time::GetSystemTime();
 
     // Create the server address
@@ -492,6 +580,9 @@ bool Server::Application::Start()
     // create the game simulation
     m_simulation = Game::GameSimulationPtr( new Game::GameSimulation() );
 
+    auto arenas = Engine::MemoryGetArenaStatistics();
+    Engine::Log( Engine::LOG_LEVEL_INFO, L"Server arenas reserved %zu bytes (%zu huge page, %zu prefaulted, %zu page faults avoided).", arenas.reserved_bytes, arenas.huge_page_bytes, arenas.prefaulted_bytes, arenas.faults_avoided );
+
     //auto server = Server::ServerFactory::CreateServer( config, networking );
     //if( server == nullptr )
     //{
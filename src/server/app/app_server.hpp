@@ -8,6 +8,9 @@
 
 #define SERVER_NUM_OF_DISCONNECT_PACKETS  ( 10 )
 #define SERVER_MAX_CONNECT_TOKENS         ( 2000 )
+#define SERVER_FRAME_ARENA_SIZE           ( 4 * 1024 * 1024 )
+#define SERVER_RECEIVE_BATCH_SIZE         ( 512 )   /* datagrams taken off the socket per tick, the rest wait for the next */
+#define SERVER_PARALLEL_READ_MIN_PACKETS  ( 16 )    /* smaller batches are decrypted on the main thread */
 
 namespace Server
 {
@@ -31,6 +34,16 @@ namespace Server
             is_confirmed( false ) {};
     }; typedef std::shared_ptr<ClientRecord> ClientRecordPtr;
 
+    /* a datagram taken off the socket this tick, and the packet it decoded to */
+    struct ReceivedDatagram
+    {
+        Engine::NetworkAddressPtr from;
+        Engine::InputBitStreamPtr read;
+        ClientRecordPtr client;
+        Engine::NetworkCryptoMapPtr crypto;
+        Engine::NetworkPacketPtr packet;
+    };
+
     struct SeenTokens
     {
         struct EntryType
@@ -57,6 +70,7 @@ namespace Server
         void Shutdown();
 
     protected:
+        void AssertFrameArenaUnreferenced();
         void CheckClientTimeouts();
         void DisconnectClient( uint64_t client_id, int num_of_disconnect_packets = SERVER_NUM_OF_DISCONNECT_PACKETS );
         ClientRecordPtr FindClientByAddress( Engine::NetworkAddressPtr &search );
@@ -67,10 +81,10 @@ namespace Server
         void OnReceivedConnectionRequest( Engine::NetworkConnectionRequestPacket &request, Engine::NetworkAddressPtr &from );
         void OnReceivedKeepAlive( Engine::NetworkKeepAlivePacket &keep_alive, ClientRecordPtr &client );
         void ProcessPacket( Engine::NetworkPacketPtr &packet, Engine::NetworkAddressPtr &from, ClientRecordPtr &client );
-        void ReadAndProcessPacket( uint64_t protocol_id, Engine::NetworkPacketTypesAllowed &allowed, Engine::NetworkAddressPtr &from, Engine::InputBitStreamPtr &read );
+        void ReadDatagram( ReceivedDatagram &datagram, Engine::MemoryAllocatorPtr &allocator, Engine::NetworkPacketTypesAllowed &allowed, const Engine::NetworkPacketSalt &salt );
         void ReceivePackets();
         void RunGameSimulation();
-        bool SendClientPacket( uint64_t client_id, Engine::NetworkPacketPtr &packet );
+        bool SendClientPacket( uint64_t client_id, Engine::NetworkPacketPtr &packet, Engine::NetworkPacketSentCallback on_sent = nullptr );
         void SendGamePacketsToClients();
 
     private:
@@ -88,6 +102,8 @@ namespace Server
 
         Game::GameSimulationPtr m_simulation;
         Engine::NetworkingPtr m_networking;
+        Engine::FrameArenaPtr m_frame_arena; /* transient packets and bitstreams, reset every tick */
+        std::vector<ReceivedDatagram> m_received; /* emptied at the end of ReceivePackets, it points into the frame arena */
     };
 
     static const wchar_t *SPLASH = L"\n"
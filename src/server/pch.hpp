@@ -23,11 +23,16 @@
 #include <codecvt>
 #include <comdef.h>
 #include <ppltasks.h>	// For create_task
+#include <ppl.h>		// For parallel_for
 #include <fstream>
 #include <array>
+#include <cmath>
 #include <map>
 #include <queue>
 #include <deque>
 #include <list>
 #include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <functional>
 #include <sodium/include/sodium.h>
@@ -2,15 +2,36 @@
 
 #include "common/app/app_sojourn.hpp"
 #include "app/app_server.hpp"
+#include "common/engine/engine_memory.hpp"
 
 int wmain( int argc, wchar_t* argv[] )
 {
     auto server_address = std::wstring( L"127.0.0.1:48000" );
-    if( argc == 2 )
+    Engine::MemoryArenaPolicy arena_policy = { Engine::MEMORY_HUGE_PAGES_NONE, false };
+    for( int i = 1; i < argc; i++ )
     {
-        server_address = std::wstring( argv[ 1 ] );
+        auto arg = std::wstring( argv[ i ] );
+        if( arg == L"-prefault" )
+        {
+            arena_policy.prefault = true;
+        }
+        else if( arg == L"-hugepages" )
+        {
+            arena_policy.huge_pages = Engine::MEMORY_HUGE_PAGES_TRANSPARENT;
+        }
+        else if( arg == L"-hugepages=explicit" )
+        {
+            arena_policy.huge_pages = Engine::MEMORY_HUGE_PAGES_EXPLICIT;
+        }
+        else
+        {
+            server_address = arg;
+        }
     }
 
+    /* must be set before the app builds its arenas */
+    Engine::MemorySetArenaPolicy( arena_policy );
+
     auto app = Application::Application<Server::Application>();
     return app.Run( server_address );
 